@@ -0,0 +1,158 @@
+/*
+ *  © 2020, Chris Harlow. All rights reserved.
+ *  
+ *  This file is part of DCC-EX CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "BinaryParser.h"
+#include "DCC.h"
+#include "DCCWaveform.h"
+#include "Turnouts.h"
+#include "DIAG.h"
+
+enum BINARY_OPCODE : byte {
+  THROTTLE=0x01, FUNCTION=0x02, THROTTLES=0x03, ACCESSORY=0x04,
+  TURNOUT=0x05, POWER=0x06, LOCO=0x07, CURRENT=0x08
+};
+
+// frame is a whole frame as framed by frameSize(), starting with FRAME_START.
+// A frame that is tooLong() is answered from its first 2 bytes.
+void BinaryParser::parse(Print * stream, const byte * frame, int size) {
+  byte length=frame[1];
+  if (length==0 || tooLong(length) || size!=frameSize(length)) {
+    reply(stream, BAD_CRC_OPCODE, BAD_LENGTH, NULL, 0);
+    return;
+  }
+  byte crc=0;
+  for (int i=1;i<size-1;i++) crc=crc8(crc, frame[i]);
+  byte opcode=frame[2];
+  if (crc!=frame[size-1]) {
+    if (Diag::CMD) DIAG(F("\nBinary opcode %x bad CRC\n"), opcode);
+    reply(stream, BAD_CRC_OPCODE, BAD_CRC, NULL, 0);
+    return;
+  }
+  byte replyData[8];
+  byte replySize=0;
+  byte status=execute(opcode, frame+3, length-1, replyData, replySize);
+  reply(stream, opcode | REPLY_FLAG, status, replyData, replySize);
+}
+
+bool BinaryParser::validThrottle(uint16_t cab, byte speedCode) {
+  if (cab==0) return (speedCode & 0x7F) <= 1;
+  return cab<=MAX_CAB;
+}
+
+int BinaryParser::throttleCab(const byte * frame, int size) {
+  if (size!=frameSize(4) || frame[2]!=THROTTLE) return 0;
+  return getWord(frame+3);
+}
+
+byte BinaryParser::execute(byte opcode, const byte * data, byte size, byte * replyData, byte & replySize) {
+  switch (opcode) {
+    case THROTTLE: // cab(2) speedCode
+      if (size!=3) return BAD_LENGTH;
+      if (!validThrottle(getWord(data), data[2])) return FAILED;
+      DCC::setThrottle(getWord(data), data[2] & 0x7F, (data[2] & 0x80)!=0);
+      return OK;
+      
+    case FUNCTION: // cab(2) function on
+      if (size!=4) return BAD_LENGTH;
+      if (data[2]>MAX_FUNCTION_NUMBER) return FAILED;
+      DCC::setFn(getWord(data), data[2], data[3]!=0);
+      return OK;
+      
+    case THROTTLES: // n, then n times cab(2) speedCode
+    {
+      if (size<1 || data[0]>MAX_THROTTLES || size!=1+data[0]*3) return BAD_LENGTH;
+      byte count=data[0];
+      for (byte i=0;i<count;i++) 
+        if (!validThrottle(getWord(data+1+i*3), data[3+i*3])) return FAILED;
+      THROTTLE_SETTING settings[THROTTLES_CHUNK];
+      byte chunk=0;
+      for (byte i=0;i<count;i++) {
+        const byte * setting=data+1+i*3;
+        settings[chunk++]={getWord(setting), (uint8_t)(setting[2] & 0x7F), (setting[2] & 0x80)!=0};
+        if (chunk==THROTTLES_CHUNK || i==count-1) {
+          DCC::setThrottles(settings, chunk);
+          chunk=0;
+        }
+      }
+      return OK;
+    }
+    
+    case ACCESSORY: // address(2) subaddress activate
+      if (size!=4) return BAD_LENGTH;
+      DCC::setAccessory(getWord(data), data[2], data[3]!=0);
+      return OK;
+
+    case TURNOUT: // id(2) thrown
+      if (size!=3) return BAD_LENGTH;
+      return Turnout::activate(getWord(data), data[2]!=0) ? OK : FAILED;
+
+    case POWER: // on
+    {
+      if (size!=1) return BAD_LENGTH;
+      POWERMODE mode= data[0] ? POWERMODE::ON : POWERMODE::OFF;
+      DCC::setProgTrackSyncMain(false);
+      DCCWaveform::mainTrack.setPowerMode(mode);
+      DCCWaveform::progTrack.setPowerMode(mode);
+      if (mode == POWERMODE::OFF) DCC::setProgTrackBoost(false);
+      return OK;
+    }
+    
+    case LOCO: // cab(2) -> cab(2) speedCode functions(4)
+    {
+      if (size!=2) return BAD_LENGTH;
+      int cab=getWord(data);
+      unsigned long functions=DCC::getFunctionMap(cab);
+      putWord(replyData, cab);
+      replyData[2]=DCC::getThrottleSpeed(cab) | (DCC::getThrottleDirection(cab) ? 0x80 : 0);
+      putWord(replyData+3, functions & 0xFFFF);
+      putWord(replyData+5, functions >> 16);
+      replySize=7;
+      return OK;
+    }
+    
+    case CURRENT: // -> mA(2) maxmA(2) tripmA(2)
+      if (size!=0) return BAD_LENGTH;
+      putWord(replyData, DCCWaveform::mainTrack.getCurrentmA());
+      putWord(replyData+2, DCCWaveform::mainTrack.getMaxmA());
+      putWord(replyData+4, DCCWaveform::mainTrack.getTripmA());
+      replySize=6;
+      return OK;
+  }
+  return UNKNOWN_OPCODE;
+}
+
+void BinaryParser::reply(Print * stream, byte opcode, byte status, const byte * data, byte size) {
+  byte length=size+2;  // opcode and status
+  byte crc=crc8(crc8(crc8(0, length), opcode), status);
+  stream->write(FRAME_START);
+  stream->write(length);
+  stream->write(opcode);
+  stream->write(status);
+  for (byte i=0;i<size;i++) {
+    stream->write(data[i]);
+    crc=crc8(crc, data[i]);
+  }
+  stream->write(crc);
+}
+
+// CRC-8, polynomial 0x07, bitwise to save a 256 byte table
+byte BinaryParser::crc8(byte crc, byte value) {
+  crc ^= value;
+  for (byte bit=0;bit<8;bit++) crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+  return crc;
+}
@@ -0,0 +1,70 @@
+/*
+ *  © 2020, Chris Harlow. All rights reserved.
+ *  
+ *  This file is part of DCC-EX CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef BinaryParser_h
+#define BinaryParser_h
+#include <Arduino.h>
+
+/* Compact binary commands for computer links, accepted wherever <...> commands are.
+ * 
+ * Frame:  0xA5 LEN OPCODE data... CRC 
+ *    LEN counts OPCODE and data, CRC is CRC-8 (polynomial 0x07) of LEN, OPCODE and data.
+ *    LEN is at most MAX_LENGTH, a longer frame is answered with BAD_LENGTH and its bytes skipped.
+ *    Words are 2 bytes, low byte first.
+ * Reply:  0xA5 LEN OPCODE|0x80 STATUS data... CRC 
+ *    A frame with a bad CRC is answered with OPCODE 0xFF.
+ *
+ * Speed codes are as sent to the loco: bit 7 forward, 0 stop, 1 emergency stop, 2-127 speed.
+ * Cabs are 1-16383, cab 0 is a broadcast to every loco and only takes stop or emergency stop.
+ * A THROTTLES frame with any bad setting is refused as a whole.
+ *
+ *  OPCODE               data                                  reply data
+ *  0x01 THROTTLE        cab(2) speedCode                      
+ *  0x02 FUNCTION        cab(2) function on                     
+ *  0x03 THROTTLES       n (up to 15), then n times cab(2) speedCode      
+ *  0x04 ACCESSORY       address(2) subaddress activate        
+ *  0x05 TURNOUT         id(2) thrown                          
+ *  0x06 POWER           on                                    
+ *  0x07 LOCO            cab(2)                                cab(2) speedCode functions(4)
+ *  0x08 CURRENT                                               mA(2) maxmA(2) tripmA(2)
+ */
+class BinaryParser {
+  public:
+    static const byte FRAME_START=0xA5;
+    static const byte FRAME_OVERHEAD=3;  // start, length and CRC
+    static const byte MAX_LENGTH=47;     // whole frame fits the USB serial parser's buffer 
+    static const byte MAX_THROTTLES=(MAX_LENGTH-2)/3;  // settings in a THROTTLES frame 
+    static int frameSize(byte length) { return length + FRAME_OVERHEAD; }
+    static bool tooLong(byte length) { return length > MAX_LENGTH; }
+    static void parse(Print * stream, const byte * frame, int size);
+    static int throttleCab(const byte * frame, int size);  // cab a THROTTLE frame sets, 0 if not one 
+
+  private:
+    enum STATUS : byte { OK=0, BAD_LENGTH=1, UNKNOWN_OPCODE=2, FAILED=3, BAD_CRC=4 };
+    static const byte REPLY_FLAG=0x80;
+    static const byte BAD_CRC_OPCODE=0xFF;
+    static byte execute(byte opcode, const byte * data, byte size, byte * replyData, byte & replySize);
+    static const uint16_t MAX_CAB=0x3FFF;   // 14 bit DCC address 
+    static const byte THROTTLES_CHUNK=8;    // settings passed to DCC::setThrottles at a time
+    static bool validThrottle(uint16_t cab, byte speedCode);
+    static void reply(Print * stream, byte opcode, byte status, const byte * data, byte size);
+    static byte crc8(byte crc, byte value);
+    static uint16_t getWord(const byte * data) { return data[0] | (data[1] << 8); }
+    static void putWord(byte * data, uint16_t value) { data[0]=lowByte(value); data[1]=highByte(value); }
+};
+#endif
@@ -17,15 +17,538 @@
  *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
  */
 #include <Arduino.h>
+#include "config.h"
+#include "defines.h"
 #include "CommandDistributor.h"
 #include "WiThrottle.h"
+#include "DCCWaveform.h"
+#include "StringFormatter.h"
+#include "DIAG.h"
+#include "BinaryParser.h"
+#if Z21_ON == true
+#include "Z21Server.h"
+#endif
+
+const int HASH_KEYWORD_ALL = keywordHash("ALL");
+const int HASH_KEYWORD_NONE = keywordHash("NONE");
+const int HASH_KEYWORD_LOCO = keywordHash("LOCO");
+const int HASH_KEYWORD_TURNOUT = keywordHash("TURNOUT");
+const int HASH_KEYWORD_SENSOR = keywordHash("SENSOR");
+const int HASH_KEYWORD_POWER = keywordHash("POWER");
+const int HASH_KEYWORD_CURRENT = keywordHash("CURRENT");
+const int HASH_KEYWORD_ON = keywordHash("ON");
+
+constexpr int SUBSCRIBE_KEYWORDS[] = {
+    HASH_KEYWORD_ALL, HASH_KEYWORD_NONE, HASH_KEYWORD_LOCO, HASH_KEYWORD_TURNOUT,
+    HASH_KEYWORD_SENSOR, HASH_KEYWORD_POWER, HASH_KEYWORD_CURRENT, HASH_KEYWORD_ON,
+};
+static_assert(keywordsUnique(SUBSCRIBE_KEYWORDS, sizeof(SUBSCRIBE_KEYWORDS) / sizeof(SUBSCRIBE_KEYWORDS[0])),
+              "Two <U> keywords have the same hash");
+static_assert(BinaryParser::MAX_LENGTH + BinaryParser::FRAME_OVERHEAD < MAX_PARTIAL_COMMAND,
+              "A binary frame split across chunks must fit a partial command");
 
 DCCEXParser * CommandDistributor::parser=0; 
+CLIENT_SESSION CommandDistributor::sessions[MAX_SESSIONS];
+CLIENT_SESSION * CommandDistributor::currentSession=NULL;
+PARTIAL_COMMAND * CommandDistributor::partials[MAX_PARTIALS];
+byte CommandDistributor::pendingLocos[(MAX_LOCOS + 7) / 8];
+bool CommandDistributor::pendingTurnouts=false;
+bool CommandDistributor::pendingSensors=false;
+bool CommandDistributor::pendingPower=false;
+bool CommandDistributor::pendingCurrent=false;
+unsigned long CommandDistributor::lastCurrentCheck=0;
+int CommandDistributor::lastCurrentmA=0;
+
+// Split a received chunk into commands and execute each of them. 
+// A DCC-EX command runs from < to >, a WiThrottle command is a line
+// and a binary command is a frame starting with BinaryParser::FRAME_START.
+// Transports deliver whatever arrived, so several commands may be in one chunk
+// and a command may be split across chunks. 
+// The buffer must have room for one byte after length.
+int  CommandDistributor::parse(byte clientId,byte * buffer, int length, RingStream * streamer) {
+  int commands=0;
+  CLIENT_SESSION * session=lookupSession(streamer, clientId, true);
+  PARTIAL_COMMAND * partial= session ? session->partial : NULL;
+  if (partial) {
+    // add to the command held from the previous chunk and see if it is now complete
+    int held=partial->length;
+    int added=min(length, MAX_PARTIAL_COMMAND-held);
+    memcpy(partial->buffer+held, buffer, added);
+    int size=commandSize(partial->buffer, held+added);
+    partial->inUse=false;  // free before executing so the command can't see itself 
+    session->partial=NULL;
+    int refused=refuseFrame(session, partial->buffer, held+added, streamer);
+    if (refused) {
+      buffer+=refused-held;
+      length-=refused-held;
+    }
+    else if (size==0) {
+      partial->length=held+added;
+      if (partial->length<MAX_PARTIAL_COMMAND) {  // still incomplete, wait for more 
+        partial->inUse=true;
+        session->partial=partial;
+        return 0;
+      }
+      DIAG(F("\nCommand too long from client %d, dropped\n"), clientId);
+      startSkip(session, partial->buffer, partial->length);
+      buffer+=added;
+      length-=added;
+    }
+    else {
+      if (parseCommand(session, clientId, partial->buffer, size, streamer)) commands++;
+      buffer+=size-held;
+      length-=size-held;
+    }
+  }
+  
+  while (length>0) {
+    if (session && session->skip!=SKIP_NONE) {
+      int skipped=skipInput(session, buffer, length);
+      buffer+=skipped;
+      length-=skipped;
+      continue;
+    }
+    if (*buffer=='\r' || *buffer=='\n' || *buffer==' ' || *buffer=='\0') {  // noise between commands
+      buffer++;
+      length--;
+      continue;
+    }
+    int refused=refuseFrame(session, buffer, length, streamer);
+    if (refused) {
+      buffer+=refused;
+      length-=refused;
+      continue;
+    }
+    int size=commandSize(buffer, length);
+    if (size==0) {
+      holdPartial(session, buffer, length);
+      return commands;
+    }
+    if (parseCommand(session, clientId, buffer, size, streamer)) commands++;
+    buffer+=size;
+    length-=size;
+  }
+  return commands;
+}
+
+// Size of the complete command at start, 0 if it is not all there yet
+int CommandDistributor::commandSize(const byte * start, int length) {
+  if (start[0]==BinaryParser::FRAME_START) {
+    if (length<2) return 0;
+    int size=BinaryParser::frameSize(start[1]);
+    return size<=length ? size : 0;
+  }
+  byte terminator= start[0]=='<' ? '>' : '\n';
+  for (int i=0;i<length;i++) 
+    if (start[i]==terminator || (terminator=='\n' && start[i]=='\r')) return i+1;
+  return 0;
+}
 
-void  CommandDistributor::parse(byte clientId,byte * buffer, RingStream * streamer) {
- if (buffer[0] == '<')  {
-    if (!parser) parser = new DCCEXParser();
+// <t [reg] cab speed dir> or a binary THROTTLE frame 
+int CommandDistributor::throttleCab(const byte * command, int size) {
+  if (command[0]==BinaryParser::FRAME_START) return BinaryParser::throttleCab(command, size);
+  if (size<3 || command[0]!='<' || command[1]!='t') return 0;
+  int p[4];
+  byte params=0;
+  for (int i=2; i<size && params<4; i++) {
+    if (!isdigit(command[i])) continue;
+    int value=0;
+    while (i<size && isdigit(command[i])) value=value*10 + (command[i++]-'0');
+    p[params++]=value;
+  }
+  return params>=3 ? p[params-3] : 0;
+}
+
+void CommandDistributor::holdPartial(CLIENT_SESSION * session, byte * start, int length) {
+  PARTIAL_COMMAND * partial=NULL;
+  if (session && length<MAX_PARTIAL_COMMAND) {
+    for (byte i=0;i<MAX_PARTIALS && !partial;i++) {
+      if (!partials[i]) partials[i]=new PARTIAL_COMMAND();
+      if (partials[i] && !partials[i]->inUse) partial=partials[i];
+    }
+  }
+  if (!partial) {
+    DIAG(F("\nCommand split from client %d can not be held, dropped\n"), session ? session->clientId : -1);
+    if (session) startSkip(session, start, length);
+    return;
+  }
+  memcpy(partial->buffer, start, length);
+  partial->length=length;
+  partial->inUse=true;
+  session->partial=partial;
+}
+
+// The rest of a dropped command will arrive in the next chunks and must not be 
+// taken for commands. start is the part received, length bytes of it. 
+// A binary frame's data may hold any byte, so its length says where it ends.
+void CommandDistributor::startSkip(CLIENT_SESSION * session, const byte * start, int length) {
+  if (start[0]==BinaryParser::FRAME_START) {
+    if (length<2) session->skip=SKIP_FRAME;
+    else {
+      session->skip=SKIP_BYTES;
+      session->skipBytes=BinaryParser::frameSize(start[1])-length;
+    }
+  }
+  else session->skip= start[0]=='<' ? SKIP_TO_START : SKIP_LINE;
+}
+
+// A binary frame longer than BinaryParser::MAX_LENGTH can't be held or executed. It is 
+// answered with BAD_LENGTH and its bytes thrown away. Returns how many bytes of start
+// belong to it, 0 if start is not such a frame. 
+int CommandDistributor::refuseFrame(CLIENT_SESSION * session, const byte * start, int length, RingStream * streamer) {
+  if (start[0]!=BinaryParser::FRAME_START || length<2 || !BinaryParser::tooLong(start[1])) return 0;
+  BinaryParser::parse(streamer, start, 2);
+  int size=BinaryParser::frameSize(start[1]);
+  if (size<=length) return size;
+  if (session) startSkip(session, start, length);
+  return length;
+}
+
+// Bytes at the start of buffer that belong to a dropped command
+int CommandDistributor::skipInput(CLIENT_SESSION * session, const byte * buffer, int length) {
+  for (int i=0;i<length;i++) {
+    byte ch=buffer[i];
+    if (session->skip==SKIP_FRAME) {
+      session->skip=SKIP_BYTES;
+      session->skipBytes=BinaryParser::frameSize(ch)-2;
+      continue;
+    }
+    if (session->skip==SKIP_BYTES) {
+      int rest=length-i;
+      if (rest<(int)session->skipBytes) {
+        session->skipBytes-=rest;
+        return length;
+      }
+      session->skip=SKIP_NONE;
+      return i+session->skipBytes;
+    }
+    if (session->skip==SKIP_LINE && (ch=='\n' || ch=='\r')) {
+      session->skip=SKIP_NONE;
+      return i+1;
+    }
+    if (session->skip==SKIP_TO_START && (ch=='<' || ch==BinaryParser::FRAME_START)) {
+      session->skip=SKIP_NONE;
+      return i;
+    }
+  }
+  return length;
+}
+
+// The protocol is decided by the first command, after that a DCC-EX client's
+// stray lines are ignored rather than starting a WiThrottle. 
+// Binary frames can not be mistaken for anything else, so they are always executed. 
+bool  CommandDistributor::parseCommand(CLIENT_SESSION * session, byte clientId, byte * buffer, int size, RingStream * streamer) {
+ bool binary= buffer[0] == BinaryParser::FRAME_START;
+ bool dccex= buffer[0] == '<';
+ if (session) {
+   if (session->protocol==PROTOCOL_UNKNOWN) 
+     session->protocol= binary ? PROTOCOL_BINARY : dccex ? PROTOCOL_DCCEX : PROTOCOL_WITHROTTLE;
+   else if (session->protocol==PROTOCOL_BINARY && dccex) session->protocol=PROTOCOL_DCCEX;
+   else if (session->protocol==PROTOCOL_WITHROTTLE) dccex=false;
+   else if (!binary && !dccex) return false;
+   session->commands++;
+ }
+ if (binary) {
+   BinaryParser::parse(streamer, buffer, size);
+   return true;
+ }
+ // terminate just after this command, execute it, then put back the byte we overwrote 
+ byte saved=buffer[size];
+ buffer[size]='\0';
+ if (dccex)  {
+    currentSession=session;
+    int freeBefore=streamer->freeSpace();
+    if (!parser) {
+      parser = new DCCEXParser();
+      DCCEXParser::addCommand('U', 0, 3, subscribe); // only network clients can subscribe
+    }
     parser->parse(streamer, buffer, true); // tell JMRI parser that ACKS are blocking because we can't handle the async
+    int written=freeBefore-streamer->freeSpace();
+    if (session && written>0) session->bytesSent+=written;
+    currentSession=NULL;
+  }
+  else if (session) {
+    if (!session->throttle) session->throttle=WiThrottle::getThrottle(streamer, clientId);
+    session->throttle->parse(streamer, buffer);
   }
-  else WiThrottle::getThrottle(clientId)->parse(streamer, buffer);
+  else WiThrottle::getThrottle(streamer, clientId)->parse(streamer, buffer);
+  buffer[size]=saved;
+  return true;
+}
+
+void CommandDistributor::forget(RingStream * streamer, byte clientId) {
+  CLIENT_SESSION * session=lookupSession(streamer, clientId, false);
+  if (session) {
+    if (session->partial) session->partial->inUse=false;
+    session->ring=NULL;
+  }
+  WiThrottle::forget(streamer, clientId);
+}
+
+// Everything received before the loss has been parsed. The command held from it 
+// would be joined to whatever comes after the gap, so it goes, and so does the 
+// rest of the command cut by the gap. 
+void CommandDistributor::lostInput(RingStream * streamer, byte clientId) {
+  CLIENT_SESSION * session=lookupSession(streamer, clientId, false);
+  if (!session) return;
+  if (session->partial) {
+    // bytes are missing, so not even a binary frame can be skipped by its length 
+    byte first=session->partial->buffer[0];
+    session->skip= (first=='<' || first==BinaryParser::FRAME_START) ? SKIP_TO_START : SKIP_LINE;
+    session->partial->inUse=false;
+    session->partial=NULL;
+  }
+  else if (session->protocol==PROTOCOL_WITHROTTLE) session->skip=SKIP_LINE;
+  else if (session->protocol!=PROTOCOL_UNKNOWN) session->skip=SKIP_TO_START;
+}
+
+// The WiThrottle has gone by itself, e.g. after a heartbeat timeout 
+void CommandDistributor::throttleDeleted(RingStream * streamer, byte clientId) {
+  CLIENT_SESSION * session=lookupSession(streamer, clientId, false);
+  if (session) session->throttle=NULL;
+}
+
+// Find (or add) the session for a network client. 
+// Clients live at sessions[clientId] unless two transports use the same id, 
+// so a lookup almost never looks further. A free slot does not end the search 
+// because the client may have been placed beyond it before it was freed. 
+CLIENT_SESSION * CommandDistributor::lookupSession(RingStream * streamer, byte clientId, bool create) {
+  CLIENT_SESSION * freeSession=NULL;
+  byte slot=clientId % MAX_SESSIONS;
+  for (byte i=0;i<MAX_SESSIONS;i++) {
+    CLIENT_SESSION * session=&sessions[slot];
+    if (session->ring==streamer && session->clientId==clientId) return session;
+    if (session->ring==NULL && !freeSession) freeSession=session;
+    if (++slot==MAX_SESSIONS) slot=0;
+  }
+  if (!create) return NULL;
+  if (!freeSession) {
+    DIAG(F("\nToo many clients, %d will not receive broadcasts\n"), clientId);
+    return NULL;
+  }
+  freeSession->ring=streamer;
+  freeSession->clientId=clientId;
+  freeSession->protocol=PROTOCOL_UNKNOWN;
+  freeSession->throttle=NULL;
+  freeSession->partial=NULL;
+  freeSession->skip=SKIP_NONE;
+  freeSession->skipBytes=0;
+  freeSession->commands=0;
+  freeSession->bytesSent=0;
+  freeSession->filtered=0;
+  subscribeAll(freeSession);
+  return freeSession;
+}
+
+void CommandDistributor::subscribeAll(CLIENT_SESSION * client) {
+  client->flags=SUBSCRIBE_ALL_LOCOS | SUBSCRIBE_POWER | SUBSCRIBE_CURRENT;
+  memset(client->locos,0,sizeof(client->locos));
+  client->turnoutFrom=0;
+  client->turnoutTo=32767;
+  client->sensorFrom=0;
+  client->sensorTo=32767;
+}
+
+/* <U>                    reply <U bytesSent filtered> for this client
+ * <U ALL>                everything (the default)
+ * <U NONE>               nothing, follow with the items wanted
+ * <U LOCO cab>           add a loco, up to MAX_SUBSCRIBED_LOCOS, the first replaces all locos
+ * <U TURNOUT from to>    turnout ids from..to
+ * <U SENSOR from to>     sensor ids from..to
+ * <U POWER ON|OFF>       
+ * <U CURRENT ON|OFF>     
+ */ 
+bool CommandDistributor::subscribe(Print * stream, int params, int p[], byte * com, bool blocking) {
+  (void)com; (void)blocking;
+  CLIENT_SESSION * client=currentSession;
+  if (!client) return false; // USB serial always gets everything
+  bool onOff = (params > 1) && (p[1] == 1 || p[1] == HASH_KEYWORD_ON);
+  if (params==0) {
+    StringFormatter::send(stream, F("<U %l %l>"), client->bytesSent, client->filtered);
+    return true;
+  }
+  switch (p[0]) {
+    case HASH_KEYWORD_ALL:
+      subscribeAll(client);
+      break;
+    case HASH_KEYWORD_NONE:
+      client->flags=0;
+      memset(client->locos,0,sizeof(client->locos));
+      client->turnoutFrom=client->sensorFrom=1;
+      client->turnoutTo=client->sensorTo=0;
+      break;
+    case HASH_KEYWORD_LOCO:
+      if (params!=2 || p[1]<=0) return false;
+      if (!(client->flags & SUBSCRIBE_ALL_LOCOS) && wantsLoco(client, p[1])) break;
+      for (byte i=0;i<MAX_SUBSCRIBED_LOCOS;i++) {
+        if (client->locos[i]) continue;
+        client->locos[i]=p[1];
+        client->flags &= ~SUBSCRIBE_ALL_LOCOS;
+        StringFormatter::send(stream, F("<O>"));
+        return true;
+      }
+      return false; // no room
+    case HASH_KEYWORD_TURNOUT:
+      if (params!=3) return false;
+      client->turnoutFrom=p[1];
+      client->turnoutTo=p[2];
+      break;
+    case HASH_KEYWORD_SENSOR:
+      if (params!=3) return false;
+      client->sensorFrom=p[1];
+      client->sensorTo=p[2];
+      break;
+    case HASH_KEYWORD_POWER:
+      if (onOff) client->flags |= SUBSCRIBE_POWER;
+      else client->flags &= ~SUBSCRIBE_POWER;
+      break;
+    case HASH_KEYWORD_CURRENT:
+      if (onOff) client->flags |= SUBSCRIBE_CURRENT;
+      else client->flags &= ~SUBSCRIBE_CURRENT;
+      break;
+    default:
+      return false;
+  }
+  StringFormatter::send(stream, F("<O>"));
+  return true;
+}
+
+bool CommandDistributor::wantsLoco(CLIENT_SESSION * client, int cab) {
+  if (client->flags & SUBSCRIBE_ALL_LOCOS) return true;
+  for (byte i=0;i<MAX_SUBSCRIBED_LOCOS;i++) if (client->locos[i]==(uint16_t)cab) return true;
+  return false;
+}
+
+// <D CLIENTS>
+void CommandDistributor::displayClients(Print * stream) {
+  for (byte c=0;c<MAX_SESSIONS;c++) {
+    CLIENT_SESSION * client=&sessions[c];
+    if (!client->ring) continue;
+    StringFormatter::send(stream, F("\nClient %d %S commands=%l"), client->clientId, 
+         client->protocol==PROTOCOL_DCCEX ? F("DCC-EX") : client->protocol==PROTOCOL_BINARY ? F("binary") 
+         : client->protocol==PROTOCOL_WITHROTTLE ? F("WiThrottle") : F("unknown"), client->commands);
+    if (client->protocol!=PROTOCOL_DCCEX) {
+      StringFormatter::send(stream, F("\n"));
+      continue;
+    }
+    StringFormatter::send(stream, F(" locos=%S"), (client->flags & SUBSCRIBE_ALL_LOCOS) ? F("ALL") : F(""));
+    for (byte i=0;i<MAX_SUBSCRIBED_LOCOS;i++) 
+      if (client->locos[i]) StringFormatter::send(stream, F(" %d"), client->locos[i]);
+    StringFormatter::send(stream, F(" turnouts=%d-%d sensors=%d-%d power=%d current=%d sent=%l filtered=%l\n"),
+         client->turnoutFrom, client->turnoutTo, client->sensorFrom, client->sensorTo,
+         (client->flags & SUBSCRIBE_POWER)!=0, (client->flags & SUBSCRIBE_CURRENT)!=0,
+         client->bytesSent, client->filtered);
+  }
+}
+
+void CommandDistributor::broadcastLoco(int reg) {
+  if (reg>=0 && reg<MAX_LOCOS) pendingLocos[reg>>3] |= 1<<(reg & 0x07);
+}
+
+void CommandDistributor::broadcastTurnout(Turnout * tt) {
+  tt->broadcastPending=true;
+  pendingTurnouts=true;
+}
+
+void CommandDistributor::broadcastSensor(Sensor * ss) {
+  ss->broadcastPending=true;
+  pendingSensors=true;
+}
+
+void CommandDistributor::broadcastPower() {
+  pendingPower=true;
+}
+
+// Current is sampled by the waveform far too often to publish each sample,
+// so it is checked here occasionally and only published when it moves. 
+void CommandDistributor::checkCurrent() {
+  if (millis()-lastCurrentCheck < CURRENT_CHECK_MILLIS) return;
+  lastCurrentCheck=millis();
+  int mA=DCCWaveform::mainTrack.getCurrentmA();
+  if (abs(mA-lastCurrentmA) < CURRENT_CHANGE_MA) return;
+  lastCurrentmA=mA;
+  pendingCurrent=true;
+}
+
+void CommandDistributor::loop() {
+  Sensor::checkAll();   // sensors publish their own changes
+  checkCurrent();
+  
+  bool locos=false;
+  for (byte i=0;i<sizeof(pendingLocos);i++) if (pendingLocos[i]) locos=true;
+  if (!(locos || pendingTurnouts || pendingSensors || pendingPower || pendingCurrent)) return;
+
+  // <...> clients, the USB serial first then every network client 
+  broadcastDCCEX(StringFormatter::diagSerial, NULL);
+  for (byte c=0;c<MAX_SESSIONS;c++) {
+    CLIENT_SESSION * client=&sessions[c];
+    RingStream * ring=client->ring;
+    if (!ring || client->protocol!=PROTOCOL_DCCEX) continue;
+    int freeBefore=ring->freeSpace();
+    ring->mark(client->clientId);
+    broadcastDCCEX(ring, client);
+    ring->commit();
+    int written=freeBefore-ring->freeSpace();
+    if (written>0) client->bytesSent+=written;
+  }
+
+  WiThrottle::broadcast(locos, pendingTurnouts, pendingPower);
+#if Z21_ON == true
+  Z21Server::broadcast(pendingLocos, pendingTurnouts, pendingPower, pendingCurrent);
+#endif
+
+  // Everyone has been told, so clear down the flags
+  memset(pendingLocos,0,sizeof(pendingLocos));
+  if (pendingTurnouts) 
+    for (Turnout * tt=Turnout::firstTurnout; tt!=NULL; tt=tt->nextTurnout) tt->broadcastPending=false;
+  if (pendingSensors) 
+    for (Sensor * ss=Sensor::firstSensor; ss!=NULL; ss=ss->nextSensor) ss->broadcastPending=false;
+  pendingTurnouts=false;
+  pendingSensors=false;
+  pendingPower=false;
+  pendingCurrent=false;
+}
+
+// Send the pending notifications this client has subscribed to, 
+// client is NULL for the USB serial which gets everything. 
+void CommandDistributor::broadcastDCCEX(Print * stream, CLIENT_SESSION * client) {
+  if (!stream) return;
+  if (pendingPower && client && !(client->flags & SUBSCRIBE_POWER)) client->filtered++;
+  else if (pendingPower) {
+    bool main=DCCWaveform::mainTrack.getPowerMode()==POWERMODE::ON;
+    bool prog=DCCWaveform::progTrack.getPowerMode()==POWERMODE::ON;
+    if (main && prog) StringFormatter::send(stream, DCCWaveform::progTrackSyncMain ? F("<p1 JOIN>") : F("<p1>"));
+    else if (main) StringFormatter::send(stream, F("<p1 MAIN>"));
+    else if (prog) StringFormatter::send(stream, F("<p1 PROG>"));
+    else StringFormatter::send(stream, F("<p0>"));
+  }
+  
+  for (int reg=0;reg<MAX_LOCOS;reg++) {
+    if (!(pendingLocos[reg>>3] & (1<<(reg & 0x07)))) continue;
+    int cab;
+    byte speedCode;
+    unsigned long functions;
+    if (!DCC::getLocoState(reg, cab, speedCode, functions)) continue;
+    if (client && !wantsLoco(client, cab)) client->filtered++; 
+    else StringFormatter::send(stream, F("<l %d %d %d %l>"), cab, reg, speedCode, functions);
+  }
+  
+  if (pendingTurnouts) 
+    for (Turnout * tt=Turnout::firstTurnout; tt!=NULL; tt=tt->nextTurnout)
+      if (tt->broadcastPending) {
+        if (client && (tt->data.id < client->turnoutFrom || tt->data.id > client->turnoutTo)) client->filtered++;
+        else StringFormatter::send(stream, F("<H %d %d>"), tt->data.id, (tt->data.tStatus & STATUS_ACTIVE)!=0);
+      }
+  
+  if (pendingSensors) 
+    for (Sensor * ss=Sensor::firstSensor; ss!=NULL; ss=ss->nextSensor)
+      if (ss->broadcastPending) {
+        if (client && (ss->data.snum < client->sensorFrom || ss->data.snum > client->sensorTo)) client->filtered++;
+        else StringFormatter::send(stream, F("<%c %d>"), ss->active ? 'Q' : 'q', ss->data.snum);
+      }
+
+  if (pendingCurrent && client && !(client->flags & SUBSCRIBE_CURRENT)) client->filtered++;
+  else if (pendingCurrent) 
+    StringFormatter::send(stream, F("<c CurrentMAIN %d C Milli 0 %d 1 %d>"), lastCurrentmA, 
+        DCCWaveform::mainTrack.getMaxmA(), DCCWaveform::mainTrack.getTripmA());
 }
@@ -20,13 +20,117 @@
 #define CommandDistributor_h
 #include "DCCEXParser.h"
 #include "RingStream.h"
+#include "DCC.h"
+#include "Turnouts.h"
+#include "Sensors.h"
+
+class WiThrottle;
+
+// A command split across received chunks, held until the rest arrives.
+const byte MAX_PARTIAL_COMMAND=64;
+struct PARTIAL_COMMAND {
+  bool inUse;
+  byte length;
+  byte buffer[MAX_PARTIAL_COMMAND+1];
+};
+
+// What a client speaks, decided by its first command 
+enum CLIENT_PROTOCOL : byte {
+  PROTOCOL_UNKNOWN,     // nothing complete received yet
+  PROTOCOL_DCCEX,       // <...>, binary frames are accepted too
+  PROTOCOL_BINARY,      // BinaryParser frames, becomes PROTOCOL_DCCEX on its first <...>
+  PROTOCOL_WITHROTTLE   // lines for its WiThrottle
+};
+
+// Everything known about one network client, from its first command until forget().
+// A DCC-EX client that never sends <U ...> gets every notification.
+const byte MAX_SUBSCRIBED_LOCOS=4;
+struct CLIENT_SESSION {
+  RingStream * ring;   // transport outbound ring, NULL if slot is free
+  byte clientId;
+  CLIENT_PROTOCOL protocol;
+  WiThrottle * throttle;       // PROTOCOL_WITHROTTLE, NULL until created
+  PARTIAL_COMMAND * partial;   // command split across chunks, NULL if none
+  byte skip;                   // SKIP_xxx, throwing away the rest of a dropped command
+  uint16_t skipBytes;          // SKIP_BYTES, how many are left 
+  unsigned long commands;      // executed for this client
+  // <U ...> subscription 
+  byte flags;          // SUBSCRIBE_xxx below
+  uint16_t locos[MAX_SUBSCRIBED_LOCOS]; // 0 if unused, ignored if SUBSCRIBE_ALL_LOCOS
+  int turnoutFrom, turnoutTo;  // from>to for no turnouts
+  int sensorFrom, sensorTo;
+  unsigned long bytesSent;
+  unsigned long filtered;      // notifications not sent because of the subscription
+};
 
 class CommandDistributor {
 
 public :
-  static void parse(byte clientId,byte* buffer, RingStream * streamer);
+  // buffer is any chunk of received bytes, every complete command in it is executed,
+  // returns how many were
+  static int parse(byte clientId,byte* buffer, int length, RingStream * streamer);
+  static void forget(RingStream * streamer, byte clientId); // client has disconnected
+  static void lostInput(RingStream * streamer, byte clientId); // transport threw away some of its input
+  static void throttleDeleted(RingStream * streamer, byte clientId);  // called by ~WiThrottle
+  static int commandSize(const byte * start, int length);  // 0 if the command is not all there 
+  static int throttleCab(const byte * command, int size);  // cab a speed command sets, 0 if not one 
+
+  // State change bus.
+  // Producers call these when something changes, they only set flags.
+  // loop() then sends one coalesced set of notifications to every client.
+  static void broadcastLoco(int reg);
+  static void broadcastTurnout(Turnout * tt);
+  static void broadcastSensor(Sensor * ss);
+  static void broadcastPower();
+  static void loop();
+
+  static void displayClients(Print * stream);
+   
 private:
    static DCCEXParser * parser;
+   static bool parseCommand(CLIENT_SESSION * session, byte clientId, byte * command, int size, RingStream * streamer);  // false if ignored
+
+#ifdef ARDUINO_AVR_UNO
+   static const byte MAX_PARTIALS=2;
+   static const byte MAX_SESSIONS=4;
+#else
+   static const byte MAX_PARTIALS=4;
+   static const byte MAX_SESSIONS=10;
+#endif
+   static PARTIAL_COMMAND * partials[MAX_PARTIALS]; // created on first use
+   static void holdPartial(CLIENT_SESSION * session, byte * start, int length);
+   static int refuseFrame(CLIENT_SESSION * session, const byte * start, int length, RingStream * streamer);
+   static const byte SKIP_NONE=0;
+   static const byte SKIP_LINE=1;      // up to and including the next newline
+   static const byte SKIP_TO_START=2;  // up to the next < or binary frame
+   static const byte SKIP_BYTES=3;     // skipBytes more, the rest of a binary frame 
+   static const byte SKIP_FRAME=4;     // a binary frame whose start has gone, next is its LEN 
+   static void startSkip(CLIENT_SESSION * session, const byte * start, int length);
+   static int skipInput(CLIENT_SESSION * session, const byte * buffer, int length);
+   static void checkCurrent();
+   static void broadcastDCCEX(Print * stream, CLIENT_SESSION * client);
+   
+   static const byte SUBSCRIBE_ALL_LOCOS=0x01;
+   static const byte SUBSCRIBE_POWER=0x02;
+   static const byte SUBSCRIBE_CURRENT=0x04;
+   static CLIENT_SESSION sessions[MAX_SESSIONS];
+   static CLIENT_SESSION * currentSession;  // client being parsed, NULL for USB serial
+   // <U ...> handler added to the parser, for the client currently being parsed
+   static bool subscribe(Print * stream, int params, int p[], byte * com, bool blocking);
+   static CLIENT_SESSION * lookupSession(RingStream * streamer, byte clientId, bool create);
+   static void subscribeAll(CLIENT_SESSION * client);
+   static bool wantsLoco(CLIENT_SESSION * client, int cab);
+
+   static byte pendingLocos[(MAX_LOCOS + 7) / 8];  // bit per loco table reg
+   static bool pendingTurnouts;
+   static bool pendingSensors;
+   static bool pendingPower;
+   static bool pendingCurrent;
+
+   static const unsigned long CURRENT_CHECK_MILLIS=1000;
+   static const int CURRENT_CHANGE_MA=20;  // ignore smaller changes 
+   static unsigned long lastCurrentCheck;
+   static int lastCurrentmA;
 };
 
 #endif
@@ -33,6 +33,7 @@ void setup()
     }   
 
 //  Start the WiFi interface on a MEGA, Uno cannot currently handle WiFi
+//  This returns at once, the ESP is brought up from loop() while DCC is already running.
 
 #if WIFI_ON
   WifiInterface::setup(WIFI_SERIAL_LINK_SPEED, F(WIFI_SSID), F(WIFI_PASSWORD), F(WIFI_HOSTNAME), IP_PORT);
@@ -86,11 +87,16 @@ void loop()
   EthernetInterface::loop();
 #endif
 
+  // Responsibility 4: Tell all connected clients about any state changes
+  //                   (locos, turnouts, sensors, power and current)
+  CommandDistributor::loop();
+
 #if defined(RMFT_ACTIVE) 
   RMFT::loop();
 #endif
 
   LCDDisplay::loop();  // ignored if LCD not in use 
+  StringFormatter::loop();  // drains the DIAG log when <D LOG ON>
   
 // Optionally report any decrease in memory (will automatically trigger on first call)
 #if ENABLE_FREE_MEM_WARNING
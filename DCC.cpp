@@ -19,6 +19,7 @@
  */
 #include "DCC.h"
 #include "DCCWaveform.h"
+#include "CommandDistributor.h"
 #include "DIAG.h"
 #include "EEStore.h"
 #include "GITHUB_SHA.h"
@@ -37,11 +38,14 @@
 //   Obtaining ACKs from the prog track using a function
 //   There are no volatiles here.
 
-const byte FN_GROUP_1=0x01;         
-const byte FN_GROUP_2=0x02;         
-const byte FN_GROUP_3=0x04;         
-const byte FN_GROUP_4=0x08;         
-const byte FN_GROUP_5=0x10;         
+// Groups 1-3 are flagged in the spare bits of the F0-F4 function byte
+const byte FN_GROUP_1=0x20;
+const byte FN_GROUP_2=0x40;
+const byte FN_GROUP_3=0x80;
+// Groups 4-5 are flagged in the spare bits of the address word
+const uint16_t FN_GROUP_4=0x4000;
+const uint16_t FN_GROUP_5=0x8000;
+const uint16_t LOCO_ADDRESS_MASK=0x3FFF;
 
 __FlashStringHelper* DCC::shieldName=NULL;
 
@@ -63,6 +67,24 @@ void DCC::setThrottle( uint16_t cab, uint8_t tSpeed, bool tDirection)  {
   updateLocoReminder(cab, speedCode );
 }
 
+// Set many locos in one pass through the loco table. 
+// Only the table is updated here, the speed packets are sent back to back by 
+// the reminder loop ahead of normal reminders, so the caller never waits for the track.
+void DCC::setThrottles(const THROTTLE_SETTING settings[], byte count) {
+  for (byte i=0;i<count;i++) {
+    const THROTTLE_SETTING & setting=settings[i];
+    if (setting.cab==0) {
+      setThrottle(0, setting.tSpeed, setting.tDirection); // broadcast is sent immediately
+      continue;
+    }
+    int reg=lookupSpeedTable(setting.cab);
+    if (reg<0) continue;
+    locoSpeedCode[reg] = (setting.tSpeed & 0x7F) + setting.tDirection * 128;
+    speedPending[reg>>3] |= 1<<(reg & 0x07);
+    CommandDistributor::broadcastLoco(reg);
+  }
+}
+
 void DCC::setThrottle2( uint16_t cab, byte speedCode)  {
 
   uint8_t b[4];
@@ -92,33 +114,54 @@ void DCC::setFunctionInternal(int cab, byte byte1, byte byte2) {
   DCCWaveform::mainTrack.schedulePacket(b, nB, 3);     // send packet 3 times
 }
 
+// The getters only read the loco table, a loco that is not in it 
+// is reported as a new entry would be: stopped, forward, functions off. 
 uint8_t DCC::getThrottleSpeed(int cab) {
-  int reg=lookupSpeedTable(cab);
-  if (reg<0) return -1;
-  return speedTable[reg].speedCode & 0x7F;
+  int reg=lookupSpeedTable(cab, false);
+  if (reg<0) return 0;
+  return locoSpeedCode[reg] & 0x7F;
 }
 
 bool DCC::getThrottleDirection(int cab) {
-  int reg=lookupSpeedTable(cab);
-  if (reg<0) return false ;
-  return (speedTable[reg].speedCode & 0x80) !=0;
+  int reg=lookupSpeedTable(cab, false);
+  if (reg<0) return true;
+  return (locoSpeedCode[reg] & 0x80) !=0;
+}
+
+// Find the function byte and bit mask for a function number 
+// Function bytes are F0-F4, F5-F12, F13-F20, F21-F28 in the loco table
+// and F29-F36 ... F61-F68 in the extended function pool. 
+// Returns NULL if F29+ has no pool slot (and create is false or the pool is full)
+byte * DCC::functionByte(int reg, byte functionNumber, byte & mask, bool create) {
+  if (functionNumber<=4)       { mask=1<<functionNumber;      return &locoFunctions[reg][0]; }
+  if (functionNumber<=12)      { mask=1<<(functionNumber-5);  return &locoFunctions[reg][1]; }
+  if (functionNumber<=20)      { mask=1<<(functionNumber-13); return &locoFunctions[reg][2]; }
+  if (functionNumber<=28)      { mask=1<<(functionNumber-21); return &locoFunctions[reg][3]; }
+  int slot=lookupExtendedFunctions(reg, create);
+  if (slot<0) return NULL;
+  functionNumber-=29;
+  mask=1<<(functionNumber & 0x07);
+  return &extendedFunctions[slot][functionNumber>>3]; 
 }
 
 // Set function to value on or off
 void DCC::setFn( int cab, byte functionNumber, bool on) {
-  if (cab<=0 || functionNumber>28) return;
+  if (cab<=0 || functionNumber>MAX_FUNCTION_NUMBER) return;
   int reg = lookupSpeedTable(cab);
   if (reg<0) return;  
 
   // Take care of functions:
   // Set state of function
-  unsigned long funcmask = (1UL<<functionNumber);
+  byte funcmask;
+  byte * functions=functionByte(reg, functionNumber, funcmask, true);
+  if (!functions) return;
   if (on) {
-      speedTable[reg].functions |= funcmask;
+      *functions |= funcmask;
   } else {
-      speedTable[reg].functions &= ~funcmask;
+      *functions &= ~funcmask;
   }
-  updateGroupflags(speedTable[reg].groupFlags, functionNumber);
+  updateGroupflags(reg, functionNumber);
+  CommandDistributor::broadcastLoco(reg);
   return;
 }
 
@@ -127,53 +170,118 @@ void DCC::setFn( int cab, byte functionNumber, bool on) {
 // Returns new state or -1 if nothing was changed.
 int DCC::changeFn( int cab, byte functionNumber, bool pressed) {
   int funcstate = -1;
-  if (cab<=0 || functionNumber>28) return funcstate;
+  if (cab<=0 || functionNumber>MAX_FUNCTION_NUMBER) return funcstate;
   int reg = lookupSpeedTable(cab);
   if (reg<0) return funcstate;  
 
   // Take care of functions:
   // Imitate how many command stations do it: Button press is
   // toggle but for F2 where it is momentary
-  unsigned long funcmask = (1UL<<functionNumber);
+  byte funcmask;
+  byte * functionsp = functionByte(reg, functionNumber, funcmask, true);
+  if (!functionsp) return funcstate;
+  byte & functions = *functionsp;
+  byte previous = functions;
   if (functionNumber == 2) {
       // turn on F2 on press and off again at release of button
       if (pressed) {
-	  speedTable[reg].functions |= funcmask;
+	  functions |= funcmask;
 	  funcstate = 1;
       } else {
-	  speedTable[reg].functions &= ~funcmask;
+	  functions &= ~funcmask;
 	  funcstate = 0;
       }
   } else {
       // toggle function on press, ignore release
       if (pressed) {
-	  speedTable[reg].functions ^= funcmask;
+	  functions ^= funcmask;
       }
-      funcstate = speedTable[reg].functions & funcmask;
+      funcstate = (functions & funcmask) ? 1 : 0;
   }
-  updateGroupflags(speedTable[reg].groupFlags, functionNumber);
+  updateGroupflags(reg, functionNumber);
+  if (functions!=previous) CommandDistributor::broadcastLoco(reg);
   return funcstate;
 }
 
 int DCC::getFn( int cab, byte functionNumber) {
-  if (cab<=0 || functionNumber>28) return -1;  // unknown
-  int reg = lookupSpeedTable(cab);
-  if (reg<0) return -1;  
+  if (cab<=0 || functionNumber>MAX_FUNCTION_NUMBER) return -1;  // unknown
+  int reg = lookupSpeedTable(cab, false);
+  if (reg<0) return 0;  
+
+  byte funcmask;
+  byte * functions=functionByte(reg, functionNumber, funcmask, false);
+  if (!functions) return 0; // never set so must be off
+  return  (*functions & funcmask)? 1 : 0;
+}
 
-  unsigned long funcmask = (1UL<<functionNumber);
-  return  (speedTable[reg].functions & funcmask)? 1 : 0;
+// F0-F28 as a bit map, the layout used by <l> broadcasts
+unsigned long DCC::getFunctionMap(int cab) {
+  int reg = lookupSpeedTable(cab, false);
+  if (reg<0) return 0;
+  return functionMap(reg);
+}
+
+unsigned long DCC::functionMap(int reg) {
+  return (locoFunctions[reg][0] & 0x1F)
+       | ((unsigned long)locoFunctions[reg][1] << 5)
+       | ((unsigned long)locoFunctions[reg][2] << 13)
+       | ((unsigned long)locoFunctions[reg][3] << 21);
+}
+
+// Loco table reg for a cab, -1 if it is not in the table 
+int DCC::lookupLoco(int cab) {
+  return lookupSpeedTable(cab, false);
+}
+
+// State of a loco table entry, false if the reg is unused.
+bool DCC::getLocoState(int reg, int & cab, byte & speedCode, unsigned long & functions) {
+  if (reg<0 || reg>=MAX_LOCOS || locoAddress[reg]==0) return false;
+  cab = locoAddress[reg] & LOCO_ADDRESS_MASK;
+  speedCode = locoSpeedCode[reg];
+  functions = functionMap(reg);
+  return true;
 }
 
 // Set the group flag to say we have touched the particular group.
 // A group will be reminded only if it has been touched.  
-void DCC::updateGroupflags(byte & flags, int functionNumber) {
-  byte groupMask;
-  if (functionNumber<=4)       groupMask=FN_GROUP_1;
-  else if (functionNumber<=8)  groupMask=FN_GROUP_2;
-  else if (functionNumber<=12) groupMask=FN_GROUP_3;
-  else if (functionNumber<=20) groupMask=FN_GROUP_4;
-  else                         groupMask=FN_GROUP_5;
-  flags |= groupMask; 
+void DCC::updateGroupflags(int reg, byte functionNumber) {
+  if (functionNumber<=4)       locoFunctions[reg][0] |= FN_GROUP_1;
+  else if (functionNumber<=8)  locoFunctions[reg][0] |= FN_GROUP_2;
+  else if (functionNumber<=12) locoFunctions[reg][0] |= FN_GROUP_3;
+  else if (functionNumber<=20) locoAddress[reg] |= FN_GROUP_4;
+  else if (functionNumber<=28) locoAddress[reg] |= FN_GROUP_5;
+  else {
+    // Extended groups are sent at once and then refreshed rarely
+    int slot=lookupExtendedFunctions(reg, false);
+    if (slot<0) return;
+    byte groupMask=1<<((functionNumber-29)>>3);
+    extendedTouched[slot] |= groupMask;
+    extendedDirty[slot] |= groupMask;
+  }
+}
+
+// Find the extended function pool slot for a loco table reg, optionally claiming a free one
+int DCC::lookupExtendedFunctions(int reg, bool create) {
+  int firstEmpty=-1;
+  for (int slot=0;slot<MAX_EXTENDED_FUNCTION_LOCOS;slot++) {
+    if (extendedOwner[slot]==reg+1) return slot;
+    if (extendedOwner[slot]==0 && firstEmpty<0) firstEmpty=slot;
+  }
+  if (!create) return -1;
+  if (firstEmpty<0) {
+    DIAG(F("\nToo many locos using F29+\n"));
+    return -1;
+  }
+  extendedOwner[firstEmpty]=reg+1;
+  memset(extendedFunctions[firstEmpty],0,EXTENDED_FUNCTION_BYTES);
+  extendedTouched[firstEmpty]=0;
+  extendedDirty[firstEmpty]=0;
+  return firstEmpty;
+}
+
+void DCC::forgetExtendedFunctions(int reg) {
+  int slot=lookupExtendedFunctions(reg, false);
+  if (slot>=0) extendedOwner[slot]=0;
 }
 
 void DCC::setAccessory(int address, byte number, bool activate) {
@@ -491,11 +599,15 @@ void DCC::setLocoId(int id,ACK_CALLBACK callback, bool blocking) {
 }
 
 void DCC::forgetLoco(int cab) {  // removes any speed reminders for this loco  
-  int reg=lookupSpeedTable(cab);
-  if (reg>=0) speedTable[reg].loco=0;
+  int reg=lookupSpeedTable(cab, false);
+  if (reg>=0) {
+    locoAddress[reg]=0;
+    forgetExtendedFunctions(reg);
+  }
 }
 void DCC::forgetAllLocos() {  // removes all speed reminders
-  for (int i=0;i<MAX_LOCOS;i++) speedTable[i].loco=0;  
+  for (int i=0;i<MAX_LOCOS;i++) locoAddress[i]=0;  
+  for (int i=0;i<MAX_EXTENDED_FUNCTION_LOCOS;i++) extendedOwner[i]=0;
 }
 
 byte DCC::loopStatus=0;  
@@ -510,50 +622,91 @@ void DCC::issueReminders() {
   // if the main track transmitter still has a pending packet, skip this time around.
   if ( DCCWaveform::mainTrack.packetPending) return;
 
+  // Speeds from setThrottles and newly changed F29-F68 groups jump the queue 
+  if (issuePendingSpeed()) return;
+  if (issueExtendedReminder()) return;
+
   // This loop searches for a loco in the speed table starting at nextLoco and cycling back around
   for (int reg=0;reg<MAX_LOCOS;reg++) {
        int slot=reg+nextLoco;
        if (slot>=MAX_LOCOS) slot-=MAX_LOCOS; 
-       if (speedTable[slot].loco > 0) {
+       if (locoAddress[slot]) {  // group flags are only ever set on a used slot
           // have found the next loco to remind 
           // issueReminder will return true if this loco is completed (ie speed and functions)
-          if (issueReminder(slot)) nextLoco=slot+1; 
+          if (issueReminder(slot)) {
+            if (slot<nextLoco && ++reminderCycles>=EXTENDED_REFRESH_CYCLES) {
+              // wrapped around the table often enough to refresh extended functions
+              reminderCycles=0;
+              for (int i=0;i<MAX_EXTENDED_FUNCTION_LOCOS;i++) extendedDirty[i] |= extendedTouched[i];
+            }
+            nextLoco=slot+1; 
+          }
           return;
         }
   }
 }
+
+// Send one speed queued by setThrottles, returns true if a packet was sent
+bool DCC::issuePendingSpeed() {
+  for (byte i=0;i<sizeof(speedPending);i++) {
+    byte pending=speedPending[i];
+    if (!pending) continue;
+    byte bit=0;
+    while (!(pending & (1<<bit))) bit++;
+    speedPending[i] &= ~(1<<bit);
+    int reg=(i<<3)+bit;
+    if (!locoAddress[reg]) continue; // forgotten since
+    setThrottle2(locoAddress[reg] & LOCO_ADDRESS_MASK, locoSpeedCode[reg]);
+    return true;
+  }
+  return false;
+}
+
+// Send one dirty extended function group, returns true if a packet was sent
+bool DCC::issueExtendedReminder() {
+  for (int slot=0;slot<MAX_EXTENDED_FUNCTION_LOCOS;slot++) {
+    byte dirty=extendedDirty[slot];
+    if (!dirty || !extendedOwner[slot]) continue;
+    byte group=0;
+    while (!(dirty & (1<<group))) group++;
+    extendedDirty[slot] &= ~(1<<group);
+    int loco=locoAddress[extendedOwner[slot]-1] & LOCO_ADDRESS_MASK;
+    // Feature expansion 1101 1GGG, F29-F36 is 0xD8 ... F61-F68 is 0xDC
+    setFunctionInternal(loco, 0xD8+group, extendedFunctions[slot][group]);
+    return true;
+  }
+  return false;
+}
  
 bool DCC::issueReminder(int reg) {
-  unsigned long functions=speedTable[reg].functions;
-  int loco=speedTable[reg].loco;
-  byte flags=speedTable[reg].groupFlags;
+  uint16_t address=locoAddress[reg];
+  int loco=address & LOCO_ADDRESS_MASK;
+  byte * functions=locoFunctions[reg];
   
   switch (loopStatus) {
         case 0:
-      //   DIAG(F("\nReminder %d speed %d"),loco,speedTable[reg].speedCode);
-         setThrottle2(loco, speedTable[reg].speedCode);
+      //   DIAG(F("\nReminder %d speed %d"),loco,locoSpeedCode[reg]);
+         setThrottle2(loco, locoSpeedCode[reg]);
          break;
        case 1: // remind function group 1 (F0-F4)
-          if (flags & FN_GROUP_1) 
-              setFunctionInternal(loco,0, 128 | ((functions>>1)& 0x0F) | ((functions & 0x01)<<4)); // 100D DDDD
+          if (functions[0] & FN_GROUP_1) 
+              setFunctionInternal(loco,0, 128 | ((functions[0]>>1)& 0x0F) | ((functions[0] & 0x01)<<4)); // 100D DDDD
           break;     
        case 2: // remind function group 2 F5-F8
-          if (flags & FN_GROUP_2) 
-              setFunctionInternal(loco,0, 176 | ((functions>>5)& 0x0F));                           // 1011 DDDD
+          if (functions[0] & FN_GROUP_2) 
+              setFunctionInternal(loco,0, 176 | (functions[1] & 0x0F));                           // 1011 DDDD
           break;     
        case 3: // remind function group 3 F9-F12
-          if (flags & FN_GROUP_3) 
-              setFunctionInternal(loco,0, 160 | ((functions>>9)& 0x0F));                           // 1010 DDDD
+          if (functions[0] & FN_GROUP_3) 
+              setFunctionInternal(loco,0, 160 | (functions[1]>>4));                               // 1010 DDDD
           break;   
        case 4: // remind function group 4 F13-F20
-          if (flags & FN_GROUP_4) 
-              setFunctionInternal(loco,222, ((functions>>13)& 0xFF)); 
-          flags&= ~FN_GROUP_4;  // dont send them again
+          if (address & FN_GROUP_4) 
+              setFunctionInternal(loco,222, functions[2]); 
           break;  
        case 5: // remind function group 5 F21-F28
-          if (flags & FN_GROUP_5)
-              setFunctionInternal(loco,223, ((functions>>21)& 0xFF)); 
-          flags&= ~FN_GROUP_5;  // dont send them again
+          if (address & FN_GROUP_5)
+              setFunctionInternal(loco,223, functions[3]); 
           break; 
       }
       loopStatus++;
@@ -578,24 +731,29 @@ byte DCC::cv2(int cv)  {
   return lowByte(cv);
 }
 
-int DCC::lookupSpeedTable(int locoId) {
+int DCC::lookupSpeedTable(int locoId, bool create) {
   // determine speed reg for this loco
+  if (locoId<0 || locoId>LOCO_ADDRESS_MASK) return -1; 
   int firstEmpty = MAX_LOCOS;
   int reg;
   for (reg = 0; reg < MAX_LOCOS; reg++) {
-    if (speedTable[reg].loco == locoId) break;
-    if (speedTable[reg].loco == 0 && firstEmpty == MAX_LOCOS) firstEmpty = reg;
+    uint16_t address=locoAddress[reg];
+    if ((address & LOCO_ADDRESS_MASK) == (uint16_t)locoId) break;
+    if (address == 0 && firstEmpty == MAX_LOCOS) firstEmpty = reg;
+  }
+  if (reg == MAX_LOCOS) {
+    if (!create) return -1;
+    reg = firstEmpty;
   }
-  if (reg == MAX_LOCOS) reg = firstEmpty;
   if (reg >= MAX_LOCOS) {
     DIAG(F("\nToo many locos\n"));
     return -1;
   }
   if (reg==firstEmpty){
-        speedTable[reg].loco = locoId;
-        speedTable[reg].speedCode=128;  // default direction forward
-        speedTable[reg].groupFlags=0;
-        speedTable[reg].functions=0;
+        locoAddress[reg] = locoId;
+        locoSpeedCode[reg]=128;  // default direction forward
+        memset(locoFunctions[reg],0,LOCO_FUNCTION_BYTES); // also clears group 1-3 flags
+        forgetExtendedFunctions(reg); // in case a previous owner of this reg used them 
   }
   return reg;
 }
@@ -605,17 +763,29 @@ void  DCC::updateLocoReminder(int loco, byte speedCode) {
   if (loco==0) {
      // broadcast stop/estop but dont change direction
      for (int reg = 0; reg < MAX_LOCOS; reg++) {
-       speedTable[reg].speedCode = (speedTable[reg].speedCode & 0x80) |  (speedCode & 0x7f);
+       locoSpeedCode[reg] = (locoSpeedCode[reg] & 0x80) |  (speedCode & 0x7f);
+       if (locoAddress[reg]) CommandDistributor::broadcastLoco(reg);
      }
      return; 
   }
   
   // determine speed reg for this loco
   int reg=lookupSpeedTable(loco);       
-  if (reg>=0) speedTable[reg].speedCode = speedCode;
+  if (reg>=0) {
+    locoSpeedCode[reg] = speedCode;
+    CommandDistributor::broadcastLoco(reg);
+  }
 }
 
-DCC::LOCO DCC::speedTable[MAX_LOCOS];
+uint16_t DCC::locoAddress[MAX_LOCOS];
+byte DCC::locoSpeedCode[MAX_LOCOS];
+byte DCC::locoFunctions[MAX_LOCOS][LOCO_FUNCTION_BYTES];
+byte DCC::speedPending[(MAX_LOCOS + 7) / 8];
+byte DCC::extendedOwner[MAX_EXTENDED_FUNCTION_LOCOS];
+byte DCC::extendedFunctions[MAX_EXTENDED_FUNCTION_LOCOS][EXTENDED_FUNCTION_BYTES];
+byte DCC::extendedTouched[MAX_EXTENDED_FUNCTION_LOCOS];
+byte DCC::extendedDirty[MAX_EXTENDED_FUNCTION_LOCOS];
+byte DCC::reminderCycles=0;
 int DCC::nextLoco = 0;
 
 //ACK MANAGER
@@ -852,12 +1022,12 @@ void DCC::callback(int value) {
 
     int used=0;
     for (int reg = 0; reg < MAX_LOCOS; reg++) {
-       if (speedTable[reg].loco>0) {
+       if (locoAddress[reg]) {
         used ++;
         StringFormatter::send(stream,F("\ncab=%d, speed=%d, dir=%c "),       
-           speedTable[reg].loco,  speedTable[reg].speedCode & 0x7f,(speedTable[reg].speedCode & 0x80) ? 'F':'R');
+           locoAddress[reg] & LOCO_ADDRESS_MASK,  locoSpeedCode[reg] & 0x7f,(locoSpeedCode[reg] & 0x80) ? 'F':'R');
        }
      }
-     StringFormatter::send(stream,F("\nUsed=%d, max=%d\n"),used,MAX_LOCOS);
+     StringFormatter::send(stream,F("\nUsed=%d, max=%d, %d bytes per loco\n"),used,MAX_LOCOS,LOCO_BYTES);
      
 }
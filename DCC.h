@@ -54,12 +54,33 @@ enum ackOp
 };
 
 // Allocations with memory implications..!
-// Base system takes approx 900 bytes + 8 per loco. Turnouts, Sensors etc are dynamically created
+// Base system takes approx 900 bytes + LOCO_BYTES per loco. Turnouts, Sensors etc are dynamically created
+// The loco reminder table is sized from a RAM budget, so packing the table tighter buys more locos.
 #ifdef ARDUINO_AVR_UNO
-const byte MAX_LOCOS = 20;
+const int LOCO_TABLE_BYTES = 160;
 #else
-const byte MAX_LOCOS = 50;
+const int LOCO_TABLE_BYTES = 400;
 #endif
+const byte LOCO_FUNCTION_BYTES = 4;  // F0-F4, F5-F12, F13-F20, F21-F28
+const byte LOCO_BYTES = sizeof(uint16_t) + sizeof(byte) + LOCO_FUNCTION_BYTES; // address, speed code, functions
+const byte MAX_LOCOS = LOCO_TABLE_BYTES / LOCO_BYTES;
+
+// Functions F29-F68 are rarely used so locos borrow a slot from a small pool on first use.
+#ifdef ARDUINO_AVR_UNO
+const byte MAX_EXTENDED_FUNCTION_LOCOS = 2;
+#else
+const byte MAX_EXTENDED_FUNCTION_LOCOS = 8;
+#endif
+const byte EXTENDED_FUNCTION_BYTES = 5; // F29-F36, F37-F44, F45-F52, F53-F60, F61-F68
+const byte MAX_FUNCTION_NUMBER = 68;
+
+// One entry for DCC::setThrottles
+struct THROTTLE_SETTING
+{
+  uint16_t cab;
+  uint8_t tSpeed;
+  bool tDirection;
+};
 
 class DCC
 {
@@ -69,6 +90,7 @@ public:
 
   // Public DCC API functions
   static void setThrottle(uint16_t cab, uint8_t tSpeed, bool tDirection);
+  static void setThrottles(const THROTTLE_SETTING settings[], byte count); // many locos, does not block
   static uint8_t getThrottleSpeed(int cab);
   static bool getThrottleDirection(int cab);
   static void writeCVByteMain(int cab, int cv, byte bValue);
@@ -77,7 +99,9 @@ public:
   static void setFn(int cab, byte functionNumber, bool on);
   static int changeFn(int cab, byte functionNumber, bool pressed);
   static int  getFn(int cab, byte functionNumber);
-  static void updateGroupflags(byte &flags, int functionNumber);
+  static unsigned long getFunctionMap(int cab); // F0-F28 as bits 0-28
+  static int lookupLoco(int cab);  // loco table reg, -1 if not in the table, never adds it
+  static bool getLocoState(int reg, int &cab, byte &speedCode, unsigned long &functions);
   static void setAccessory(int aAdd, byte aNum, bool activate);
   static bool writeTextPacket(byte *b, int nBytes);
   static void setProgTrackSyncMain(bool on); // when true, prog track becomes driveable
@@ -102,13 +126,6 @@ public:
   static __FlashStringHelper *getMotorShieldName();
 
 private:
-  struct LOCO
-  {
-    int loco;
-    byte speedCode;
-    byte groupFlags;
-    unsigned long functions;
-  };
   static byte loopStatus;
   static void setThrottle2(uint16_t cab, uint8_t speedCode);
   static void updateLocoReminder(int loco, byte speedCode);
@@ -117,10 +134,35 @@ private:
   static int nextLoco;
   static __FlashStringHelper *shieldName;
 
-  static LOCO speedTable[MAX_LOCOS];
+  // The loco table is held as parallel arrays so that the reminder scan and
+  // the loco lookup only touch the address words.
+  // Addresses are 14 bits, the top 2 bits flag function groups 4 and 5 as touched.
+  // Functions are packed by DCC function group so a reminder is a single byte copy,
+  // the 3 spare bits above F0-F4 flag function groups 1 to 3 as touched.
+  static uint16_t locoAddress[MAX_LOCOS];
+  static byte locoSpeedCode[MAX_LOCOS];
+  static byte locoFunctions[MAX_LOCOS][LOCO_FUNCTION_BYTES];
+  static byte speedPending[(MAX_LOCOS + 7) / 8]; // bit per loco table reg with a speed waiting to be sent
+  static bool issuePendingSpeed();
+  static byte *functionByte(int reg, byte functionNumber, byte &mask, bool create);
+  static void updateGroupflags(int reg, byte functionNumber);
+  static unsigned long functionMap(int reg);
+
+  // Extended functions F29-F68, one pool slot per loco that uses them.
+  // Newly touched groups are marked dirty and sent ahead of the reminder cycle,
+  // after that they are only refreshed every EXTENDED_REFRESH_CYCLES reminder cycles.
+  static byte extendedOwner[MAX_EXTENDED_FUNCTION_LOCOS]; // loco table reg+1, 0 when free
+  static byte extendedFunctions[MAX_EXTENDED_FUNCTION_LOCOS][EXTENDED_FUNCTION_BYTES];
+  static byte extendedTouched[MAX_EXTENDED_FUNCTION_LOCOS]; // bit per group to be refreshed
+  static byte extendedDirty[MAX_EXTENDED_FUNCTION_LOCOS];   // bit per group waiting to be sent
+  static byte reminderCycles;
+  static const byte EXTENDED_REFRESH_CYCLES = 16;
+  static int lookupExtendedFunctions(int reg, bool create);
+  static void forgetExtendedFunctions(int reg);
+  static bool issueExtendedReminder();
   static byte cv1(byte opcode, int cv);
   static byte cv2(int cv);
-  static int lookupSpeedTable(int locoId);
+  static int lookupSpeedTable(int locoId, bool create=true);
   static void issueReminders();
   static void callback(int value);
 
@@ -8,6 +8,7 @@
 #include "DCC.h"
 #include "DIAG.h"
 #include "DCCEXParser.h"
+#include "CommandDistributor.h"
 #include "version.h"
 #include "WifiInterface.h"
 #if ETHERNET_ON == true
@@ -17,6 +17,7 @@
  *  You should have received a copy of the GNU General Public License
  *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
  */
+#include "config.h"
 #include "StringFormatter.h"
 #include "DCCEXParser.h"
 #include "DCC.h"
@@ -30,27 +31,58 @@
 
 #include "EEStore.h"
 #include "DIAG.h"
-
-// These keywords are used in the <1> command. The number is what you get if you use the keyword as a parameter.
-// To discover new keyword numbers , use the <$ YOURKEYWORD> command
-const int HASH_KEYWORD_PROG = -29718;
-const int HASH_KEYWORD_MAIN = 11339;
-const int HASH_KEYWORD_JOIN = -30750;
-const int HASH_KEYWORD_CABS = -11981;
-const int HASH_KEYWORD_RAM = 25982;
-const int HASH_KEYWORD_CMD = 9962;
-const int HASH_KEYWORD_WIT = 31594;
-const int HASH_KEYWORD_WIFI = -5583;
-const int HASH_KEYWORD_ACK = 3113;
-const int HASH_KEYWORD_ON = 2657;
-const int HASH_KEYWORD_DCC = 6436;
-const int HASH_KEYWORD_SLOW = -17209;
-const int HASH_KEYWORD_PROGBOOST = -6353;
-const int HASH_KEYWORD_EEPROM = -7168;
-const int HASH_KEYWORD_LIMIT = 27413;
-const int HASH_KEYWORD_ETHERNET = -30767;    
-const int HASH_KEYWORD_MAX = 16244;
-const int HASH_KEYWORD_MIN = 15978;
+#include "CommandDistributor.h"
+#include "BinaryParser.h"
+#include "WifiInboundHandler.h"
+#include "defines.h"
+#if ETHERNET_ON == true
+#include "EthernetInterface.h"
+#endif
+
+// Keywords used as command params. keywordHash() calculates at compile time the number
+// splitValues produces when it finds the keyword in a command.
+const int HASH_KEYWORD_PROG = keywordHash("PROG");
+const int HASH_KEYWORD_MAIN = keywordHash("MAIN");
+const int HASH_KEYWORD_JOIN = keywordHash("JOIN");
+const int HASH_KEYWORD_CABS = keywordHash("CABS");
+const int HASH_KEYWORD_RAM = keywordHash("RAM");
+const int HASH_KEYWORD_CMD = keywordHash("CMD");
+const int HASH_KEYWORD_WIT = keywordHash("WIT");
+const int HASH_KEYWORD_WIFI = keywordHash("WIFI");
+const int HASH_KEYWORD_ACK = keywordHash("ACK");
+const int HASH_KEYWORD_ON = keywordHash("ON");
+const int HASH_KEYWORD_DCC = keywordHash("DCC");
+const int HASH_KEYWORD_SLOW = keywordHash("SLOW");
+const int HASH_KEYWORD_PROGBOOST = keywordHash("PROGBOOST");
+const int HASH_KEYWORD_EEPROM = keywordHash("EEPROM");
+const int HASH_KEYWORD_LIMIT = keywordHash("LIMIT");
+const int HASH_KEYWORD_ETHERNET = keywordHash("ETHERNET");
+const int HASH_KEYWORD_MAX = keywordHash("MAX");
+const int HASH_KEYWORD_MIN = keywordHash("MIN");
+const int HASH_KEYWORD_CLIENTS = keywordHash("CLIENTS");
+const int HASH_KEYWORD_PARSER = keywordHash("PARSER");
+const int HASH_KEYWORD_LOG = keywordHash("LOG");
+const int HASH_KEYWORD_RINGS = keywordHash("RINGS");
+
+constexpr int PARSER_KEYWORDS[] = {
+    HASH_KEYWORD_PROG, HASH_KEYWORD_MAIN, HASH_KEYWORD_JOIN, HASH_KEYWORD_CABS,
+    HASH_KEYWORD_RAM, HASH_KEYWORD_CMD, HASH_KEYWORD_WIT, HASH_KEYWORD_WIFI,
+    HASH_KEYWORD_ACK, HASH_KEYWORD_ON, HASH_KEYWORD_DCC, HASH_KEYWORD_SLOW,
+    HASH_KEYWORD_PROGBOOST, HASH_KEYWORD_EEPROM, HASH_KEYWORD_LIMIT, HASH_KEYWORD_ETHERNET,
+    HASH_KEYWORD_MAX, HASH_KEYWORD_MIN, HASH_KEYWORD_CLIENTS, HASH_KEYWORD_PARSER,
+    HASH_KEYWORD_LOG, HASH_KEYWORD_RINGS,
+};
+static_assert(keywordsUnique(PARSER_KEYWORDS, sizeof(PARSER_KEYWORDS) / sizeof(PARSER_KEYWORDS[0])),
+              "Two DCCEXParser keywords have the same hash, the commands can not tell them apart");
+
+#ifndef SERIAL_PARSE_MICROS
+#define SERIAL_PARSE_MICROS 2000
+#endif
+unsigned int DCCEXParser::loopBudgetMicros = SERIAL_PARSE_MICROS;
+unsigned long DCCEXParser::statsStartMillis = 0;
+unsigned int DCCEXParser::commandCount = 0;
+unsigned int DCCEXParser::commandsPerSecond = 0;
+int DCCEXParser::maxBacklog = 0;
 
 int DCCEXParser::stashP[MAX_PARAMS];
 bool DCCEXParser::stashBusy;
@@ -70,18 +102,61 @@ void DCCEXParser::flush()
         DIAG(F("\nBuffer flush"));
     bufferLength = 0;
     inCommandPayload = false;
+    inBinaryFrame = false;
 }
 
+// Executes as many buffered commands as fit in loopBudgetMicros, 
+// but always at least one, so a burst from JMRI is not held back 
+// to one command per main loop.
 void DCCEXParser::loop(Stream &stream)
 {
+    static_assert(BinaryParser::MAX_LENGTH + BinaryParser::FRAME_OVERHEAD <= MAX_BUFFER,
+                  "A binary frame must fit the buffer");
+    unsigned long startMicros = micros();
+    int backlog = stream.available();
+    if (backlog > maxBacklog)
+        maxBacklog = backlog;
+
     while (stream.available())
     {
         if (bufferLength == MAX_BUFFER)
         {
             flush();
         }
-        char ch = stream.read();
-        if (ch == '<')
+        byte ch = stream.read();
+        if (binarySkip > 0)
+        {
+            // its data may hold any byte, even < or >, so it is skipped by count
+            binarySkip--;
+            continue;
+        }
+        if (inBinaryFrame)
+        {
+            buffer[bufferLength++] = ch;
+            if (bufferLength == 2 && BinaryParser::tooLong(ch))
+            {
+                BinaryParser::parse(&stream, buffer, bufferLength); // answers BAD_LENGTH
+                binarySkip = BinaryParser::frameSize(ch) - bufferLength;
+                inBinaryFrame = false;
+                bufferLength = 0;
+                continue;
+            }
+            if (bufferLength < 2 || bufferLength < BinaryParser::frameSize(buffer[1]))
+                continue;
+            BinaryParser::parse(&stream, buffer, bufferLength);
+            inBinaryFrame = false;
+            bufferLength = 0;
+            commandCount++;
+            if (micros() - startMicros >= loopBudgetMicros)
+                break;
+        }
+        else if (ch == BinaryParser::FRAME_START && !inCommandPayload)
+        {
+            inBinaryFrame = true;
+            bufferLength = 0;
+            buffer[bufferLength++] = ch;
+        }
+        else if (ch == '<')
         {
             inCommandPayload = true;
             bufferLength = 0;
@@ -92,14 +167,28 @@ void DCCEXParser::loop(Stream &stream)
             buffer[bufferLength] = '\0';
             parse(&stream, buffer, false); // Parse this allowing async responses
             inCommandPayload = false;
-            break;
+            commandCount++;
+            if (micros() - startMicros >= loopBudgetMicros)
+                break;
         }
         else if (inCommandPayload)
         {
             buffer[bufferLength++] = ch;
         }
     }
-    Sensor::checkAll(&stream); // Update and print changes
+
+    if (millis() - statsStartMillis >= 1000)
+    {
+        commandsPerSecond = commandCount;
+        commandCount = 0;
+        statsStartMillis = millis();
+    }
+}
+
+void DCCEXParser::displayLoopStats(Print *stream)
+{
+    StringFormatter::send(stream, F("\nParser budget=%dus, commands/sec=%d, max backlog=%d bytes\n"),
+                          loopBudgetMicros, commandsPerSecond, maxBacklog);
 }
 
 int DCCEXParser::splitValues(int result[MAX_PARAMS], const byte *cmd)
@@ -147,7 +236,7 @@ int DCCEXParser::splitValues(int result[MAX_PARAMS], const byte *cmd)
             {
                 // Since JMRI got modified to send keywords in some rare cases, we need this
                 // Super Kluge to turn keywords into a hash value that can be recognised later
-                runningValue = ((runningValue << 5) + runningValue) ^ hot;
+                runningValue = (int16_t)(((runningValue << 5) + runningValue) ^ hot); // 16 bits on every processor
                 break;
             }
             result[parameterCount] = runningValue * (signNegative ? -1 : 1);
@@ -244,6 +333,68 @@ void DCCEXParser::parse(const __FlashStringHelper * cmd) {
       parse(&Serial,(byte *)buffer,true);
 }
 
+// The built in commands. 
+// Param ranges only reject what the handler could not make sense of,
+// handlers with several forms check params themselves.
+const PARSER_COMMAND DCCEXParser::commands[] PROGMEM = {
+    {'t', 3, 4, parset},               // THROTTLE <t [REGISTER] CAB SPEED DIRECTION>
+    {'f', 0, MAX_PARAMS, parsef},      // FUNCTION <f CAB BYTE1 [BYTE2]>
+    {'a', 3, 3, parsea},               // ACCESSORY <a ADDRESS SUBADDRESS ACTIVATE>
+    {'T', 0, MAX_PARAMS, parseT},      // TURNOUT  <T ...>
+    {'Z', 0, MAX_PARAMS, parseZ},      // OUTPUT <Z ...>
+    {'S', 0, MAX_PARAMS, parseS},      // SENSOR <S ...>
+    {'w', 3, 3, parsew},               // WRITE CV on MAIN <w CAB CV VALUE>
+    {'b', 4, 4, parseb},               // WRITE CV BIT ON MAIN <b CAB CV BIT VALUE>
+    {'M', 0, MAX_PARAMS, parseM},      // WRITE TRANSPARENT DCC PACKET MAIN <M REG X1 ... X9>
+    {'P', 0, MAX_PARAMS, parseM},      // WRITE TRANSPARENT DCC PACKET PROG <P REG X1 ... X9>
+    {'W', 1, 4, parseW},               // WRITE CV ON PROG <W CV VALUE CALLBACKNUM CALLBACKSUB>
+    {'V', 2, 3, parseV},               // VERIFY CV ON PROG <V CV VALUE> <V CV BIT 0|1>
+    {'B', 3, 5, parseB},               // WRITE CV BIT ON PROG <B CV BIT VALUE CALLBACKNUM CALLBACKSUB>
+    {'R', 0, 3, parseR},               // READ CV ON PROG
+    {'1', 0, 1, parsePower},           // POWERON <1   [MAIN|PROG|JOIN]>
+    {'0', 0, 1, parsePower},           // POWEROFF <0 [MAIN | PROG] >
+    {'c', 0, MAX_PARAMS, parsec},      // SEND METER RESPONSES <c>
+    {'Q', 0, MAX_PARAMS, parseQ},      // SENSORS <Q>
+    {'s', 0, MAX_PARAMS, parses},      // <s>
+    {'E', 0, MAX_PARAMS, parseE},      // STORE EPROM <E>
+    {'e', 0, MAX_PARAMS, parsee},      // CLEAR EPROM <e>
+    {' ', 0, MAX_PARAMS, parseSpace},  // < >
+    {'D', 1, MAX_PARAMS, parseD},      // DIAGNOSTICS <D ...>
+    {'#', 0, MAX_PARAMS, parseHash},   // NUMBER OF LOCOSLOTS <#>
+    {'F', 3, 3, parseF},               // New command to call the new Loco Function API <F cab func 1|0>
+    {'+', 0, MAX_PARAMS, parsePlus},   // Complex Wifi interface command (not usual parse)
+};
+
+PARSER_COMMAND DCCEXParser::addedCommands[MAX_ADDED_COMMANDS];
+byte DCCEXParser::addedCommandCount = 0;
+
+bool DCCEXParser::addCommand(byte opcode, byte minParams, byte maxParams, PARSER_HANDLER handler)
+{
+    if (addedCommandCount == MAX_ADDED_COMMANDS)
+        return false;
+    addedCommands[addedCommandCount++] = {opcode, minParams, maxParams, handler};
+    return true;
+}
+
+bool DCCEXParser::lookupCommand(byte opcode, PARSER_COMMAND &command)
+{
+    for (byte i = 0; i < addedCommandCount; i++)
+    {
+        if (addedCommands[i].opcode != opcode)
+            continue;
+        command = addedCommands[i];
+        return true;
+    }
+    for (byte i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+    {
+        if (pgm_read_byte(&commands[i].opcode) != opcode)
+            continue;
+        memcpy_P(&command, &commands[i], sizeof(command));
+        return true;
+    }
+    return false;
+}
+
 // See documentation on DCC class for info on this section
 void DCCEXParser::parse(Print *stream, byte *com, bool blocking)
 {
@@ -261,269 +412,275 @@ void DCCEXParser::parse(Print *stream, byte *com, bool blocking)
     if (filterRMFTCallback && opcode!='\0')
         filterRMFTCallback(stream, opcode, params, p);
 
-    // Functions return from this switch if complete, break from switch implies error <X> to send
-    switch (opcode)
-    {
-    case '\0':
+    if (opcode == '\0')
         return; // filterCallback asked us to ignore
-    case 't':   // THROTTLE <t [REGISTER] CAB SPEED DIRECTION>
-    {
-        int cab;
-        int tspeed;
-        int direction;
-
-        if (params == 4)
-        { // <t REGISTER CAB SPEED DIRECTION>
-            cab = p[1];
-            tspeed = p[2];
-            direction = p[3];
-        }
-        else if (params == 3)
-        { // <t CAB SPEED DIRECTION>
-            cab = p[0];
-            tspeed = p[1];
-            direction = p[2];
-        }
-        else
-            break;
+    com[0] = opcode; // handlers read the opcode from com, a filter may have changed it
 
-        // Convert DCC-EX protocol speed steps where
-        // -1=emergency stop, 0-126 as speeds
-        // to DCC 0=stop, 1= emergency stop, 2-127 speeds
-        if (tspeed > 126 || tspeed < -1)
-            break; // invalid JMRI speed code
-        if (tspeed < 0)
-            tspeed = 1; // emergency stop DCC speed
-        else if (tspeed > 0)
-            tspeed++; // map 1-126 -> 2-127
-        if (cab == 0 && tspeed > 1)
-            break; // ignore broadcasts of speed>1
-
-        if (direction < 0 || direction > 1)
-            break; // invalid direction code
-
-        DCC::setThrottle(cab, tspeed, direction);
-        if (params == 4)
-            StringFormatter::send(stream, F("<T %d %d %d>"), p[0], p[2], p[3]);
-        else
-            StringFormatter::send(stream, F("<O>"));
-        return;
+    PARSER_COMMAND command;
+    if (!lookupCommand(opcode, command))
+    { // anything else will diagnose and drop out to <X>
+        DIAG(F("\nOpcode=%c params=%d\n"), opcode, params);
+        for (int i = 0; i < params; i++)
+            DIAG(F("p[%d]=%d (0x%x)\n"), i, p[i], p[i]);
     }
-    case 'f': // FUNCTION <f CAB BYTE1 [BYTE2]>
-        if (parsef(stream, params, p))
-            return;
-        break;
-
-    case 'a': // ACCESSORY <a ADDRESS SUBADDRESS ACTIVATE>
-        if (p[2] != (p[2] & 1))
-            return;
-        DCC::setAccessory(p[0], p[1], p[2] == 1);
+    else if (params >= command.minParams && params <= command.maxParams 
+             && command.handler(stream, params, p, com, blocking))
         return;
 
-    case 'T': // TURNOUT  <T ...>
-        if (parseT(stream, params, p))
-            return;
-        break;
-
-    case 'Z': // OUTPUT <Z ...>
-        if (parseZ(stream, params, p))
-            return;
-        break;
+    // Any fallout here sends an <X>
+    StringFormatter::send(stream, F("<X>"));
+}
 
-    case 'S': // SENSOR <S ...>
-        if (parseS(stream, params, p))
-            return;
-        break;
+bool DCCEXParser::parset(Print *stream, int params, int p[], byte *com, bool blocking)
+{
+    (void)com; (void)blocking;
+    int cab;
+    int tspeed;
+    int direction;
+
+    if (params == 4)
+    { // <t REGISTER CAB SPEED DIRECTION>
+        cab = p[1];
+        tspeed = p[2];
+        direction = p[3];
+    }
+    else
+    { // <t CAB SPEED DIRECTION>
+        cab = p[0];
+        tspeed = p[1];
+        direction = p[2];
+    }
 
-    case 'w': // WRITE CV on MAIN <w CAB CV VALUE>
-        DCC::writeCVByteMain(p[0], p[1], p[2]);
-        return;
+    // Convert DCC-EX protocol speed steps where
+    // -1=emergency stop, 0-126 as speeds
+    // to DCC 0=stop, 1= emergency stop, 2-127 speeds
+    if (tspeed > 126 || tspeed < -1)
+        return false; // invalid JMRI speed code
+    if (tspeed < 0)
+        tspeed = 1; // emergency stop DCC speed
+    else if (tspeed > 0)
+        tspeed++; // map 1-126 -> 2-127
+    if (cab == 0 && tspeed > 1)
+        return false; // ignore broadcasts of speed>1
+
+    if (direction < 0 || direction > 1)
+        return false; // invalid direction code
+
+    DCC::setThrottle(cab, tspeed, direction);
+    if (params == 4)
+        StringFormatter::send(stream, F("<T %d %d %d>"), p[0], p[2], p[3]);
+    else
+        StringFormatter::send(stream, F("<O>"));
+    return true;
+}
 
-    case 'b': // WRITE CV BIT ON MAIN <b CAB CV BIT VALUE>
-        DCC::writeCVBitMain(p[0], p[1], p[2], p[3]);
-        return;
+bool DCCEXParser::parsea(Print *stream, int params, int p[], byte *com, bool blocking)
+{
+    (void)stream; (void)params; (void)com; (void)blocking;
+    if (p[2] != (p[2] & 1))
+        return true;
+    DCC::setAccessory(p[0], p[1], p[2] == 1);
+    return true;
+}
 
-    case 'M': // WRITE TRANSPARENT DCC PACKET MAIN <M REG X1 ... X9>
-    case 'P': // WRITE TRANSPARENT DCC PACKET PROG <P REG X1 ... X9>
-        // Re-parse the command using a hex-only splitter
-        params=splitHexValues(p,com)-1; // drop REG
-        if (params<1) break;  
-        {
-          byte packet[params];
-          for (int i=0;i<params;i++) {
-            packet[i]=(byte)p[i+1];
-            if (Diag::CMD) DIAG(F("packet[%d]=%d (0x%x)\n"), i, packet[i], packet[i]);
-          }
-          (opcode=='M'?DCCWaveform::mainTrack:DCCWaveform::progTrack).schedulePacket(packet,params,3);  
-        }
-        return;
-        
-    case 'W': // WRITE CV ON PROG <W CV VALUE CALLBACKNUM CALLBACKSUB>
-            if (!stashCallback(stream, p))
-                break;
-        if (params == 1) // <W id> Write new loco id (clearing consist and managing short/long)
-            DCC::setLocoId(p[0],callback_Wloco, blocking);
-        else // WRITE CV ON PROG <W CV VALUE [CALLBACKNUM] [CALLBACKSUB]>
-            DCC::writeCVByte(p[0], p[1], callback_W, blocking);
-        return;
+bool DCCEXParser::parsew(Print *stream, int params, int p[], byte *com, bool blocking)
+{
+    (void)stream; (void)params; (void)com; (void)blocking;
+    DCC::writeCVByteMain(p[0], p[1], p[2]);
+    return true;
+}
 
-    case 'V': // VERIFY CV ON PROG <V CV VALUE> <V CV BIT 0|1>
-        if (params == 2)
-        { // <V CV VALUE>
-            if (!stashCallback(stream, p))
-                break;
-            DCC::verifyCVByte(p[0], p[1], callback_Vbyte, blocking);
-            return;
-        }
-        if (params == 3)
-        {
-            if (!stashCallback(stream, p))
-                break;
-            DCC::verifyCVBit(p[0], p[1], p[2], callback_Vbit, blocking);
-            return;
-        }
-        break;
+bool DCCEXParser::parseb(Print *stream, int params, int p[], byte *com, bool blocking)
+{
+    (void)stream; (void)params; (void)com; (void)blocking;
+    DCC::writeCVBitMain(p[0], p[1], p[2], p[3]);
+    return true;
+}
 
-    case 'B': // WRITE CV BIT ON PROG <B CV BIT VALUE CALLBACKNUM CALLBACKSUB>
-        if (!stashCallback(stream, p))
-            break;
-        DCC::writeCVBit(p[0], p[1], p[2], callback_B, blocking);
-        return;
+bool DCCEXParser::parseM(Print *stream, int params, int p[], byte *com, bool blocking)
+{
+    (void)stream; (void)blocking;
+    // Re-parse the command using a hex-only splitter
+    params=splitHexValues(p,com)-1; // drop REG
+    if (params<1) return false;  
+    byte packet[params];
+    for (int i=0;i<params;i++) {
+      packet[i]=(byte)p[i+1];
+      if (Diag::CMD) DIAG(F("packet[%d]=%d (0x%x)\n"), i, packet[i], packet[i]);
+    }
+    (com[0]=='M'?DCCWaveform::mainTrack:DCCWaveform::progTrack).schedulePacket(packet,params,3);  
+    return true;
+}
+        
+bool DCCEXParser::parseW(Print *stream, int params, int p[], byte *com, bool blocking)
+{
+    (void)com;
+    if (!stashCallback(stream, p))
+        return false;
+    if (params == 1) // <W id> Write new loco id (clearing consist and managing short/long)
+        DCC::setLocoId(p[0],callback_Wloco, blocking);
+    else // WRITE CV ON PROG <W CV VALUE [CALLBACKNUM] [CALLBACKSUB]>
+        DCC::writeCVByte(p[0], p[1], callback_W, blocking);
+    return true;
+}
 
-    case 'R': // READ CV ON PROG
-        if (params == 3)
-        { // <R CV CALLBACKNUM CALLBACKSUB>
-            if (!stashCallback(stream, p))
-                break;
-            DCC::readCV(p[0], callback_R, blocking);
-            return;
-        }
-        if (params == 0)
-        { // <R> New read loco id
-            if (!stashCallback(stream, p))
-                break;
-            DCC::getLocoId(callback_Rloco, blocking);
-            return;
-        }
-        break;
+bool DCCEXParser::parseV(Print *stream, int params, int p[], byte *com, bool blocking)
+{
+    (void)com;
+    if (!stashCallback(stream, p))
+        return false;
+    if (params == 2) // <V CV VALUE>
+        DCC::verifyCVByte(p[0], p[1], callback_Vbyte, blocking);
+    else // <V CV BIT 0|1>
+        DCC::verifyCVBit(p[0], p[1], p[2], callback_Vbit, blocking);
+    return true;
+}
 
-    case '1': // POWERON <1   [MAIN|PROG]>
-    case '0': // POWEROFF <0 [MAIN | PROG] >
-        if (params > 1)
-            break;
-        {
-            POWERMODE mode = opcode == '1' ? POWERMODE::ON : POWERMODE::OFF;
-            DCC::setProgTrackSyncMain(false); // Only <1 JOIN> will set this on, all others set it off
-            if (params == 0)
-            {
-                DCCWaveform::mainTrack.setPowerMode(mode);
-                DCCWaveform::progTrack.setPowerMode(mode);
-		if (mode == POWERMODE::OFF)
-		  DCC::setProgTrackBoost(false);  // Prog track boost mode will not outlive prog track off
-                StringFormatter::send(stream, F("<p%c>"), opcode);
-                return;
-            }
-            switch (p[0])
-            {
-            case HASH_KEYWORD_MAIN:
-                DCCWaveform::mainTrack.setPowerMode(mode);
-                StringFormatter::send(stream, F("<p%c MAIN>"), opcode);
-                return;
-
-            case HASH_KEYWORD_PROG:
-                DCCWaveform::progTrack.setPowerMode(mode);
-		if (mode == POWERMODE::OFF)
-		  DCC::setProgTrackBoost(false);  // Prog track boost mode will not outlive prog track off
-                StringFormatter::send(stream, F("<p%c PROG>"), opcode);
-                return;
-            case HASH_KEYWORD_JOIN:
-                DCCWaveform::mainTrack.setPowerMode(mode);
-                DCCWaveform::progTrack.setPowerMode(mode);
-                if (mode == POWERMODE::ON)
-                {
-                    DCC::setProgTrackSyncMain(true);
-                    StringFormatter::send(stream, F("<p1 JOIN>"), opcode);
-                }
-                else
-                    StringFormatter::send(stream, F("<p0>"));
-                return;
-            }
-            break;
-        }
-        return;
+bool DCCEXParser::parseB(Print *stream, int params, int p[], byte *com, bool blocking)
+{
+    (void)params; (void)com;
+    if (!stashCallback(stream, p))
+        return false;
+    DCC::writeCVBit(p[0], p[1], p[2], callback_B, blocking);
+    return true;
+}
 
-    case 'c': // SEND METER RESPONSES <c>
-        //                               <c MeterName value C/V unit min max res warn>
-        StringFormatter::send(stream, F("<c CurrentMAIN %d C Milli 0 %d 1 %d>"), DCCWaveform::mainTrack.getCurrentmA(), 
-            DCCWaveform::mainTrack.getMaxmA(), DCCWaveform::mainTrack.getTripmA());
-        StringFormatter::send(stream, F("<a %d>"), DCCWaveform::mainTrack.get1024Current()); //'a' message deprecated, remove once JMRI 4.22 is available
-        return;
+bool DCCEXParser::parseR(Print *stream, int params, int p[], byte *com, bool blocking)
+{
+    (void)com;
+    if (params == 3)
+    { // <R CV CALLBACKNUM CALLBACKSUB>
+        if (!stashCallback(stream, p))
+            return false;
+        DCC::readCV(p[0], callback_R, blocking);
+        return true;
+    }
+    if (params == 0)
+    { // <R> New read loco id
+        if (!stashCallback(stream, p))
+            return false;
+        DCC::getLocoId(callback_Rloco, blocking);
+        return true;
+    }
+    return false;
+}
 
-    case 'Q': // SENSORS <Q>
-        Sensor::printAll(stream);
-        return;
+bool DCCEXParser::parsePower(Print *stream, int params, int p[], byte *com, bool blocking)
+{
+    (void)stream; (void)blocking;
+    POWERMODE mode = com[0] == '1' ? POWERMODE::ON : POWERMODE::OFF;
+    DCC::setProgTrackSyncMain(false); // Only <1 JOIN> will set this on, all others set it off
+    if (params == 0)
+    {
+        DCCWaveform::mainTrack.setPowerMode(mode);
+        DCCWaveform::progTrack.setPowerMode(mode);
+	if (mode == POWERMODE::OFF)
+	  DCC::setProgTrackBoost(false);  // Prog track boost mode will not outlive prog track off
+        return true; // <p..> is broadcast to all clients by the CommandDistributor
+    }
+    switch (p[0])
+    {
+    case HASH_KEYWORD_MAIN:
+        DCCWaveform::mainTrack.setPowerMode(mode);
+        return true;
 
-    case 's': // <s>
-        StringFormatter::send(stream, F("<p%d>"), DCCWaveform::mainTrack.getPowerMode() == POWERMODE::ON);
-        StringFormatter::send(stream, F("<iDCC-EX V-%S / %S / %S G-%S>"), F(VERSION), F(ARDUINO_TYPE), DCC::getMotorShieldName(), F(GITHUB_SHA));
-        Turnout::printAll(stream); //send all Turnout states
-        Output::printAll(stream);  //send all Output  states
-        Sensor::printAll(stream);  //send all Sensor  states
-        // TODO Send stats of  speed reminders table
-        return;       
-
-    case 'E': // STORE EPROM <E>
-        EEStore::store();
-        StringFormatter::send(stream, F("<e %d %d %d>"), EEStore::eeStore->data.nTurnouts, EEStore::eeStore->data.nSensors, EEStore::eeStore->data.nOutputs);
-        return;
+    case HASH_KEYWORD_PROG:
+        DCCWaveform::progTrack.setPowerMode(mode);
+	if (mode == POWERMODE::OFF)
+	  DCC::setProgTrackBoost(false);  // Prog track boost mode will not outlive prog track off
+        return true;
+    case HASH_KEYWORD_JOIN:
+        DCCWaveform::mainTrack.setPowerMode(mode);
+        DCCWaveform::progTrack.setPowerMode(mode);
+        if (mode == POWERMODE::ON)
+            DCC::setProgTrackSyncMain(true);
+        return true;
+    }
+    return false;
+}
 
-    case 'e': // CLEAR EPROM <e>
-        EEStore::clear();
-        StringFormatter::send(stream, F("<O>"));
-        return;
+bool DCCEXParser::parsec(Print *stream, int params, int p[], byte *com, bool blocking)
+{
+    (void)params; (void)p; (void)com; (void)blocking;
+    //                               <c MeterName value C/V unit min max res warn>
+    StringFormatter::send(stream, F("<c CurrentMAIN %d C Milli 0 %d 1 %d>"), DCCWaveform::mainTrack.getCurrentmA(), 
+        DCCWaveform::mainTrack.getMaxmA(), DCCWaveform::mainTrack.getTripmA());
+    StringFormatter::send(stream, F("<a %d>"), DCCWaveform::mainTrack.get1024Current()); //'a' message deprecated, remove once JMRI 4.22 is available
+    return true;
+}
 
-    case ' ': // < >
-        StringFormatter::send(stream, F("\n"));
-        return;
+bool DCCEXParser::parseQ(Print *stream, int params, int p[], byte *com, bool blocking)
+{
+    (void)params; (void)p; (void)com; (void)blocking;
+    Sensor::printAll(stream);
+    return true;
+}
 
-    case 'D': // < >
-        if (parseD(stream, params, p))
-            return;
-        return;
+bool DCCEXParser::parses(Print *stream, int params, int p[], byte *com, bool blocking)
+{
+    (void)params; (void)p; (void)com; (void)blocking;
+    StringFormatter::send(stream, F("<p%d>"), DCCWaveform::mainTrack.getPowerMode() == POWERMODE::ON);
+    StringFormatter::send(stream, F("<iDCC-EX V-%S / %S / %S G-%S>"), F(VERSION), F(ARDUINO_TYPE), DCC::getMotorShieldName(), F(GITHUB_SHA));
+    Turnout::printAll(stream); //send all Turnout states
+    Output::printAll(stream);  //send all Output  states
+    Sensor::printAll(stream);  //send all Sensor  states
+    // TODO Send stats of  speed reminders table
+    return true;
+}
 
-    case '#': // NUMBER OF LOCOSLOTS <#>
-        StringFormatter::send(stream, F("<# %d>"), MAX_LOCOS);
-        return;
+bool DCCEXParser::parseE(Print *stream, int params, int p[], byte *com, bool blocking)
+{
+    (void)params; (void)p; (void)com; (void)blocking;
+    EEStore::store();
+    StringFormatter::send(stream, F("<e %d %d %d>"), EEStore::eeStore->data.nTurnouts, EEStore::eeStore->data.nSensors, EEStore::eeStore->data.nOutputs);
+    return true;
+}
 
-    case 'F': // New command to call the new Loco Function API <F cab func 1|0>
-        if (Diag::CMD)
-            DIAG(F("Setting loco %d F%d %S"), p[0], p[1], p[2] ? F("ON") : F("OFF"));
-        DCC::setFn(p[0], p[1], p[2] == 1);
-        return;
+bool DCCEXParser::parsee(Print *stream, int params, int p[], byte *com, bool blocking)
+{
+    (void)params; (void)p; (void)com; (void)blocking;
+    EEStore::clear();
+    StringFormatter::send(stream, F("<O>"));
+    return true;
+}
 
-    case '+': // Complex Wifi interface command (not usual parse)
-        if (atCommandCallback) {
-          DCCWaveform::mainTrack.setPowerMode(POWERMODE::OFF);
-          DCCWaveform::progTrack.setPowerMode(POWERMODE::OFF);
-          atCommandCallback(com);
-          return;
-        }
-        break;
+bool DCCEXParser::parseSpace(Print *stream, int params, int p[], byte *com, bool blocking)
+{
+    (void)params; (void)p; (void)com; (void)blocking;
+    StringFormatter::send(stream, F("\n"));
+    return true;
+}
 
-    default: //anything else will diagnose and drop out to <X>
-        DIAG(F("\nOpcode=%c params=%d\n"), opcode, params);
-        for (int i = 0; i < params; i++)
-            DIAG(F("p[%d]=%d (0x%x)\n"), i, p[i], p[i]);
-        break;
+bool DCCEXParser::parseHash(Print *stream, int params, int p[], byte *com, bool blocking)
+{
+    (void)params; (void)p; (void)com; (void)blocking;
+    StringFormatter::send(stream, F("<# %d>"), MAX_LOCOS);
+    return true;
+}
 
-    } // end of opcode switch
+bool DCCEXParser::parseF(Print *stream, int params, int p[], byte *com, bool blocking)
+{
+    (void)stream; (void)params; (void)com; (void)blocking;
+    if (Diag::CMD)
+        DIAG(F("Setting loco %d F%d %S"), p[0], p[1], p[2] ? F("ON") : F("OFF"));
+    DCC::setFn(p[0], p[1], p[2] == 1);
+    return true;
+}
 
-    // Any fallout here sends an <X>
-    StringFormatter::send(stream, F("<X>"));
+bool DCCEXParser::parsePlus(Print *stream, int params, int p[], byte *com, bool blocking)
+{
+    (void)stream; (void)params; (void)p; (void)blocking;
+    if (!atCommandCallback)
+        return false;
+    DCCWaveform::mainTrack.setPowerMode(POWERMODE::OFF);
+    DCCWaveform::progTrack.setPowerMode(POWERMODE::OFF);
+    atCommandCallback(com);
+    return true;
 }
 
-bool DCCEXParser::parseZ(Print *stream, int params, int p[])
+bool DCCEXParser::parseZ(Print *stream, int params, int p[], byte *com, bool blocking)
 {
+    (void)com; (void)blocking;
 
     switch (params)
     {
@@ -566,8 +723,9 @@ bool DCCEXParser::parseZ(Print *stream, int params, int p[])
 }
 
 //===================================
-bool DCCEXParser::parsef(Print *stream, int params, int p[])
+bool DCCEXParser::parsef(Print *stream, int params, int p[], byte *com, bool blocking)
 {
+    (void)com; (void)blocking;
     // JMRI sends this info in DCC message format but it's not exactly
     //      convenient for other processing
     if (params == 2)
@@ -593,6 +751,8 @@ bool DCCEXParser::parsef(Print *stream, int params, int p[])
             funcmap(p[0], p[2], 13, 20);
         else if (p[1] == 223)
             funcmap(p[0], p[2], 21, 28);
+        else if (p[1] >= 216 && p[1] <= 220) // feature expansion F29-F36 ... F61-F68
+            funcmap(p[0], p[2], 29 + (p[1] - 216) * 8, 36 + (p[1] - 216) * 8);
     }
     (void)stream; // NO RESPONSE
     return true;
@@ -608,8 +768,9 @@ void DCCEXParser::funcmap(int cab, byte value, byte fstart, byte fstop)
 }
 
 //===================================
-bool DCCEXParser::parseT(Print *stream, int params, int p[])
+bool DCCEXParser::parseT(Print *stream, int params, int p[], byte *com, bool blocking)
 {
+    (void)com; (void)blocking;
     switch (params)
     {
     case 0: // <T>  list turnout definitions
@@ -635,8 +796,7 @@ bool DCCEXParser::parseT(Print *stream, int params, int p[])
         Turnout *tt = Turnout::get(p[0]);
         if (!tt)
             return false;
-        tt->activate(p[1]);
-        StringFormatter::send(stream, F("<H %d %d>"), tt->data.id, (tt->data.tStatus & STATUS_ACTIVE)!=0);
+        tt->activate(p[1]); // <H id state> is broadcast to all clients
     }
         return true;
 
@@ -651,8 +811,9 @@ bool DCCEXParser::parseT(Print *stream, int params, int p[])
     }
 }
 
-bool DCCEXParser::parseS(Print *stream, int params, int p[])
+bool DCCEXParser::parseS(Print *stream, int params, int p[], byte *com, bool blocking)
 {
+    (void)com; (void)blocking;
 
     switch (params)
     {
@@ -683,8 +844,9 @@ bool DCCEXParser::parseS(Print *stream, int params, int p[])
     return false;
 }
 
-bool DCCEXParser::parseD(Print *stream, int params, int p[])
+bool DCCEXParser::parseD(Print *stream, int params, int p[], byte *com, bool blocking)
 {
+    (void)com; (void)blocking;
     if (params == 0)
         return false;
     bool onOff = (params > 0) && (p[1] == 1 || p[1] == HASH_KEYWORD_ON); // dont care if other stuff or missing... just means off
@@ -695,8 +857,22 @@ bool DCCEXParser::parseD(Print *stream, int params, int p[])
         return true;
 
     case HASH_KEYWORD_RAM: // <D RAM>
-        StringFormatter::send(stream, F("\nFree memory=%d\n"), freeMemory());
-        break;
+        StringFormatter::send(stream, F("\nFree memory=%d, locos=%d at %d bytes each\n"), freeMemory(), MAX_LOCOS, LOCO_BYTES);
+        return true;
+
+    case HASH_KEYWORD_PARSER: // <D PARSER [budget microseconds]>
+        if (params >= 2 && p[1] > 0)
+            loopBudgetMicros = p[1];
+        displayLoopStats(stream);
+        return true;
+
+    case HASH_KEYWORD_RINGS: // <D RINGS>
+        RingStream::printAllStats(stream);
+        return true;
+
+    case HASH_KEYWORD_CLIENTS: // <D CLIENTS>
+        CommandDistributor::displayClients(stream);
+        return true;
 
     case HASH_KEYWORD_ACK: // <D ACK ON/OFF> <D ACK [LIMIT|MIN|MAX] Value>
 	if (params >= 3) {
@@ -720,11 +896,25 @@ bool DCCEXParser::parseD(Print *stream, int params, int p[])
         Diag::CMD = onOff;
         return true;
 
-    case HASH_KEYWORD_WIFI: // <D WIFI ON/OFF>
-        Diag::WIFI = onOff;
+    case HASH_KEYWORD_WIFI: // <D WIFI ON/OFF> or <D WIFI> for client queue statistics
+        if (params == 1)
+            WifiInboundHandler::displayStats(stream);
+        else
+            Diag::WIFI = onOff;
+        return true;
+
+    case HASH_KEYWORD_LOG: // <D LOG ON/OFF>
+        if (!StringFormatter::setLog(onOff) && onOff)
+            StringFormatter::send(stream, F("\nNo memory for DIAG log\n"));
         return true;
 
-   case HASH_KEYWORD_ETHERNET: // <D ETHERNET ON/OFF>
+   case HASH_KEYWORD_ETHERNET: // <D ETHERNET ON/OFF> or <D ETHERNET> for socket statistics
+#if ETHERNET_ON == true
+        if (params == 1) {
+            EthernetInterface::displayStats(stream);
+            return true;
+        }
+#endif
         Diag::ETHERNET = onOff;
         return true;
 
@@ -23,6 +23,32 @@
 typedef void (*FILTER_CALLBACK)(Print * stream, byte & opcode, byte & paramCount, int p[]);
 typedef void (*AT_COMMAND_CALLBACK)(const byte * command);
 
+// A command handler returns false to have <X> sent back.
+// p[] holds the params splitValues found, com is the command text starting at the opcode,
+// com[0] is the opcode as left by any filter.
+typedef bool (*PARSER_HANDLER)(Print * stream, int params, int p[], byte * com, bool blocking);
+
+struct PARSER_COMMAND {
+  byte opcode;
+  byte minParams;   // <X> is sent without calling the handler if params are out of range
+  byte maxParams;
+  PARSER_HANDLER handler;
+};
+
+// Keywords in commands arrive as the hash splitValues calculates for them, 
+// keywordHash("MAIN") gives the same number at compile time.
+constexpr int keywordHash(const char * keyword, uint16_t hash=0) {
+  return *keyword ? keywordHash(keyword+1, (uint16_t)(((hash << 5) + hash) ^ (byte)*keyword)) 
+                  : (int16_t)hash;
+}
+
+// True if no two hashes in the list are the same, for static_assert on a keyword list  
+constexpr bool keywordsUnique(const int * hashes, int count, int i=0, int j=1) {
+  return i >= count-1 ? true 
+       : j >= count ? keywordsUnique(hashes, count, i+1, i+2)
+       : hashes[i]!=hashes[j] && keywordsUnique(hashes, count, i, j+1);
+}
+
 struct DCCEXParser
 {
    DCCEXParser();
@@ -34,28 +60,66 @@ struct DCCEXParser
    static void setRMFTFilter(FILTER_CALLBACK filter);
    static void setAtCommandCallback(AT_COMMAND_CALLBACK filter);
    static const int MAX_PARAMS=10;  // Must not exceed this
+   // Optional modules add their own opcodes here rather than editing the parser, 
+   // these are checked before the built in commands. False if the table is full. 
+   static bool addCommand(byte opcode, byte minParams, byte maxParams, PARSER_HANDLER handler);
  
    private:
   
+    // loop() executes buffered commands until this many microseconds have gone
+    static unsigned int loopBudgetMicros;
+    static unsigned long statsStartMillis;
+    static unsigned int commandCount;       // commands executed by loop() since statsStartMillis
+    static unsigned int commandsPerSecond;  // over the last whole second
+    static int maxBacklog;                  // most bytes seen waiting at the start of loop()
+    static void displayLoopStats(Print * stream);
+  
     static const int MAX_BUFFER=50;  // longest command sent in
      byte  bufferLength=0;
      bool  inCommandPayload=false;
+     bool  inBinaryFrame=false;  // collecting a BinaryParser frame
+     int   binarySkip=0;         // bytes left of a frame refused as too long 
      byte  buffer[MAX_BUFFER+2]; 
-    int splitValues( int result[MAX_PARAMS], const byte * command);
-    int splitHexValues( int result[MAX_PARAMS], const byte * command);
+    static int splitValues( int result[MAX_PARAMS], const byte * command);
+    static int splitHexValues( int result[MAX_PARAMS], const byte * command);
+
+    static const PARSER_COMMAND commands[] PROGMEM;
+    static const byte MAX_ADDED_COMMANDS=4;
+    static PARSER_COMMAND addedCommands[MAX_ADDED_COMMANDS];
+    static byte addedCommandCount;
+    static bool lookupCommand(byte opcode, PARSER_COMMAND & command);
      
-     bool parseT(Print * stream, int params, int p[]);
-     bool parseZ(Print * stream, int params, int p[]);
-     bool parseS(Print * stream,  int params, int p[]);
-     bool parsef(Print * stream,  int params, int p[]);
-     bool parseD(Print * stream,  int params, int p[]);
+     static bool parset(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parsea(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parseT(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parseZ(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parseS(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parsef(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parsew(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parseb(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parseM(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parseW(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parseV(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parseB(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parseR(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parsePower(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parsec(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parseQ(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parses(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parseE(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parsee(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parseSpace(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parseD(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parseHash(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parseF(Print * stream, int params, int p[], byte * com, bool blocking);
+     static bool parsePlus(Print * stream, int params, int p[], byte * com, bool blocking);
 
     
     static bool stashBusy;
    
     static Print * stashStream;
     static int stashP[MAX_PARAMS];
-    bool stashCallback(Print * stream, int p[MAX_PARAMS]);
+    static bool stashCallback(Print * stream, int p[MAX_PARAMS]);
     static void callback_W(int result);
     static void callback_B(int result);        
     static void callback_R(int result);
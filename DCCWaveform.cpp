@@ -21,6 +21,7 @@
 
 #include "DCCWaveform.h"
 #include "DIAG.h"
+#include "CommandDistributor.h"
  
 const int NORMAL_SIGNAL_TIME=58;  // this is the 58uS DCC 1-bit waveform half-cycle 
 const int SLOW_SIGNAL_TIME=NORMAL_SIGNAL_TIME*512;
@@ -119,6 +120,7 @@ void DCCWaveform::setPowerMode(POWERMODE mode) {
   powerMode = mode;
   bool ison = (mode == POWERMODE::ON);
   motorDriver->setPower( ison);
+  CommandDistributor::broadcastPower(); // every call is told, so a repeated <1> still gets its <p1>
 }
 
 
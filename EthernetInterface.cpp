@@ -24,6 +24,9 @@
 #include "EthernetInterface.h"
 #include "DIAG.h"
 #include "CommandDistributor.h"
+#if Z21_ON == true
+#include "Z21Server.h"
+#endif
 
 EthernetInterface * EthernetInterface::singleton=NULL;
 /**
@@ -70,6 +73,16 @@ EthernetInterface::EthernetInterface()
     }
     
     connected=true;
+
+    // MAX_SOCK_NUM is what the library was built for, a W5100 only has 4 
+    clientSockets = Ethernet.hardwareStatus() == EthernetW5100 ? 4 : 8;
+    if (clientSockets > MAX_SOCK_NUM) clientSockets=MAX_SOCK_NUM;
+#ifdef UDP_PORT
+    clientSockets--;
+#endif
+#if Z21_ON == true
+    clientSockets--;   // its UDP port 
+#endif
     
     IPAddress ip = Ethernet.localIP(); // reassign the obtained ip address
 
@@ -79,7 +92,30 @@ EthernetInterface::EthernetInterface()
     LCD(4,F("IP: %d.%d.%d.%d"), ip[0], ip[1], ip[2], ip[3]);
     LCD(5,F("Port:%d"), LISTEN_PORT);
 
-    outboundRing=new RingStream(OUTBOUND_RING_SIZE);     
+    outboundRing=new RingStream(OUTBOUND_RING_SIZE,F("Ethernet out"));     
+    nextSocket=0;
+    memset(stats,0,sizeof(stats));
+    memset(staleReplies,0,sizeof(staleReplies));
+    passes=0;
+    passesCut=0;
+    lastIdleCheck=0;
+    idleClosed=0;
+    evicted=0;
+
+#ifdef UDP_PORT
+    udp=new EthernetUDP();
+    udp->begin(UDP_PORT);
+    udpRing=new RingStream(UDP_RING_SIZE,F("Ethernet UDP"));
+    memset(cabSequences,0,sizeof(cabSequences));
+    datagrams=0;
+    udpCommands=0;
+    staleCommands=0;
+    udpDropped=0;
+    DIAG(F("\nEthernet UDP port %d\n"), UDP_PORT);
+#endif
+#if Z21_ON == true
+    Z21Server::setup();
+#endif
 }
 
 /**
@@ -124,55 +160,272 @@ void EthernetInterface::loop()
         if (Diag::ETHERNET) DIAG(F("\nEthernet: New client "));
         byte socket;
         for (socket = 0; socket < MAX_SOCK_NUM; socket++)
-        {
-            if (!clients[socket])
-            {
-                // On accept() the EthernetServer doesn't track the client anymore
-                // so we store it in our client array
-                if (Diag::ETHERNET) DIAG(F("%d\n"),socket);
-                clients[socket] = client;
-                break;
-            }
+            if (!clients[socket]) break;
+        if (socket==MAX_SOCK_NUM) {
+            // make way for the newcomer, the quiet one is most likely a phone that has gone
+            socket=quietestSocket();
+            closeSocket(socket, F("evicted"));
+            evicted++;
         }
-        if (socket==MAX_SOCK_NUM) DIAG(F("new Ethernet OVERFLOW\n")); 
+        // On accept() the EthernetServer doesn't track the client anymore
+        // so we store it in our client array
+        if (Diag::ETHERNET) DIAG(F("%d\n"),socket);
+        clients[socket] = client;
+        CommandDistributor::forget(outboundRing, socket);
+        memset(&stats[socket],0,sizeof(stats[socket]));
+        stats[socket].lastMillis=millis();
     }
 
-    // check for incoming data from all possible clients
-    for (byte socket = 0; socket < MAX_SOCK_NUM; socket++)
+    // Give every client with data one read per pass, starting after the last one 
+    // served so a busy low socket can't keep the others waiting. If the budget
+    // runs out, the next pass carries on from where this one stopped.
+    unsigned long start=micros();
+    passes++;
+#ifdef UDP_PORT
+    // datagrams first, they are the ones in a hurry 
+    while (readDatagram() && micros()-start <= ETHERNET_LOOP_BUDGET) {}
+#endif
+#if Z21_ON == true
+    while (Z21Server::loop() && micros()-start <= ETHERNET_LOOP_BUDGET) {}
+#endif
+    for (byte n = 0; n < MAX_SOCK_NUM; n++)
     {
-        if (clients[socket]) {
-        
-        int available=clients[socket].available();
-        if (available > 0) {
-            if (Diag::ETHERNET)  DIAG(F("\nEthernet: available socket=%d,avail=%d,count="), socket, available);
-            // read bytes from a client
-            int count = clients[socket].read(buffer, MAX_ETH_BUFFER);
-            buffer[count] = '\0'; // terminate the string properly
-            if (Diag::ETHERNET) DIAG(F("%d:%e\n"), socket,buffer);
-            // execute with data going directly back
-            outboundRing->mark(socket); 
-            CommandDistributor::parse(socket,buffer,outboundRing);
-            outboundRing->commit();
-            return; // limit the amount of processing that takes place within 1 loop() cycle. 
-          }
+        byte socket=(nextSocket+n) % MAX_SOCK_NUM;
+        if (!readSocket(socket)) continue;
+        if (micros()-start > ETHERNET_LOOP_BUDGET) {
+          nextSocket=(socket+1) % MAX_SOCK_NUM;
+          passesCut++;
+          break;
         }
     }
 
     // stop any clients which disconnect
-   for (int socket = 0; socket<MAX_SOCK_NUM; socket++) {
-     if (clients[socket] && !clients[socket].connected()) {
-      clients[socket].stop();
-      if (Diag::ETHERNET)  DIAG(F("\nEthernet: disconnect %d \n"), socket);             
-     }
+   for (byte socket = 0; socket<MAX_SOCK_NUM; socket++) {
+     if (clients[socket] && !clients[socket].connected()) closeSocket(socket, F("disconnect"));
     }
+    checkIdle();
     
-    // handle at most 1 outbound transmission 
-    int socketOut=outboundRing->read();
-    if (socketOut>=0) {
-      int count=outboundRing->count();
-      if (Diag::ETHERNET) DIAG(F("Ethernet reply socket=%d, count=:%d\n"), socketOut,count);
-      for(;count>0;count--)  clients[socketOut].write(outboundRing->read());
-      clients[socketOut].flush(); //maybe 
+    // send replies while there is budget left, but always at least one 
+    while (sendReply() && micros()-start <= ETHERNET_LOOP_BUDGET) {}
+}
+
+// Read and execute what one client has sent, false if it had nothing 
+bool EthernetInterface::readSocket(byte socket)
+{
+    if (!clients[socket]) return false;
+    int available=clients[socket].available();
+    if (available <= 0) return false;
+    // leave it in the shield until there is room for the replies 
+    if (outboundRing->freeSpace() < OUTBOUND_RING_RESERVE) return false;
+    if (Diag::ETHERNET)  DIAG(F("\nEthernet: available socket=%d,avail=%d,count="), socket, available);
+    // read bytes from a client
+    int count = clients[socket].read(buffer, MAX_ETH_BUFFER);
+    if (count <= 0) return false;
+    buffer[count] = '\0'; // terminate the string properly
+    if (Diag::ETHERNET) DIAG(F("%d:%e\n"), socket,buffer);
+    ETHERNET_SOCKET_STATS * st=&stats[socket];
+    unsigned long readMicros=micros();
+    st->bytesIn+=count;
+    st->lastMillis=millis();
+    // execute with data going directly back
+    int freeBefore=outboundRing->freeSpace();
+    outboundRing->mark(socket); 
+    st->commands+=CommandDistributor::parse(socket,buffer,count,outboundRing);
+    outboundRing->commit();
+    if (outboundRing->freeSpace()<freeBefore && !st->waiting) {
+      st->waiting=true;
+      st->readMicros=readMicros;
+    }
+    return true;
+}
+
+// Stop the client and free everything kept for it. Its replies still in the
+// ring would go to the next client given this socket, so they are counted
+// here and sendReply() drops them. Nothing more is queued once it is forgotten.
+void EthernetInterface::closeSocket(byte socket, const __FlashStringHelper * why)
+{
+    clients[socket].stop();
+    CommandDistributor::forget(outboundRing, socket);
+    int offset=0;
+    int length;
+    int id;
+    staleReplies[socket]=0;
+    while ((id=outboundRing->peekHeader(length,offset))>=0) {
+      if (id==socket) staleReplies[socket]++;
+      offset+=RingStream::HEADER_SIZE+length;
+    }
+    stats[socket].waiting=false;
+    if (Diag::ETHERNET)  DIAG(F("\nEthernet: %S %d \n"), why, socket);             
+}
+
+// The client that has been silent longest, MAX_SOCK_NUM if there are none 
+byte EthernetInterface::quietestSocket()
+{
+    byte quietest=MAX_SOCK_NUM;
+    for (byte socket = 0; socket < MAX_SOCK_NUM; socket++) {
+      if (!clients[socket]) continue;
+      if (quietest==MAX_SOCK_NUM || 
+          millis()-stats[socket].lastMillis > millis()-stats[quietest].lastMillis) quietest=socket;
+    }
+    return quietest;
+}
+
+// Once a second, close clients silent for ETHERNET_IDLE_SECONDS. 
+// The server listens on a socket of its own, so when all the others hold clients
+// nobody new can connect at all. If ETHERNET_EVICT_SECONDS is set the client silent 
+// longest is then closed, once it has been quiet that long, to keep one socket free. 
+void EthernetInterface::checkIdle()
+{
+    if (millis()-lastIdleCheck < 1000) return;
+    lastIdleCheck=millis();
+    byte inUse=0;
+    for (byte socket = 0; socket < MAX_SOCK_NUM; socket++) {
+      if (!clients[socket]) continue;
+      if (ETHERNET_IDLE_SECONDS && millis()-stats[socket].lastMillis > ETHERNET_IDLE_SECONDS*1000UL) {
+        closeSocket(socket, F("idle"));
+        idleClosed++;
+        continue;
+      }
+      inUse++;
+    }
+    if (ETHERNET_EVICT_SECONDS==0 || inUse+1 < clientSockets) return;
+    byte quietest=quietestSocket();
+    if (millis()-stats[quietest].lastMillis < ETHERNET_EVICT_SECONDS*1000UL) return;
+    closeSocket(quietest, F("evicted"));
+    evicted++;
+}
+
+// Send the oldest queued reply, false if there is none 
+bool EthernetInterface::sendReply()
+{
+    int count;
+    int socketOut=outboundRing->readHeader(count);
+    if (socketOut<0) return false;
+    if (staleReplies[socketOut]>0) {
+      staleReplies[socketOut]--;
+      outboundRing->skip(count);
+      return true;
+    }
+    if (Diag::ETHERNET) DIAG(F("Ethernet reply socket=%d, count=:%d\n"), socketOut,count);
+    outboundRing->writeTo(&clients[socketOut], count);  // whole reply per SPI send, not a packet per byte 
+    clients[socketOut].flush(); //maybe 
+    ETHERNET_SOCKET_STATS * st=&stats[socketOut];
+    st->bytesOut+=count;
+    st->replies++;
+    if (st->waiting) {
+      unsigned long latency=micros()-st->readMicros;
+      st->waiting=false;
+      st->timed++;
+      st->totalLatency+=latency;
+      if (latency>st->maxLatency) st->maxLatency=latency;
+    }
+    return true;
+}
+
+#ifdef UDP_PORT
+// A datagram is an optional sequence number then <...> commands or binary frames,
+// for example "17<t 1 3 50 1>". Speed commands older than the newest one already
+// applied to their cab have arrived late and are skipped.
+// The replies go back in one datagram starting with the same sequence number,
+// so a sequenced datagram is always acknowledged. 
+bool EthernetInterface::readDatagram()
+{
+    int size=udp->parsePacket();
+    if (size<=0) return false;
+    datagrams++;
+    if (size>MAX_ETH_BUFFER) {
+      udpDropped++;  // the next parsePacket() discards it 
+      return true;
+    }
+    int count=udp->read(buffer, MAX_ETH_BUFFER);
+    if (count<=0) return true;
+    buffer[count]='\0';
+    if (Diag::ETHERNET) DIAG(F("\nEthernet UDP %d:%e\n"), count, buffer);
+
+    int start=0;
+    uint16_t sequence=0;
+    while (start<count && isdigit(buffer[start])) sequence=sequence*10 + (buffer[start++]-'0');
+    bool sequenced=start>0;
+    uint32_t sender=udp->remoteIP();
+    uint16_t port=udp->remotePort();
+
+    udpRing->mark(UDP_CLIENT_ID);
+    if (sequenced) StringFormatter::send(udpRing, F("%l"), (unsigned long)sequence);
+    byte * command=buffer+start;
+    int length=count-start;
+    while (length>0) {
+      int size=CommandDistributor::commandSize(command, length);
+      if (size==0) size=length;  // incomplete, parse() drops it below
+      int cab= sequenced ? CommandDistributor::throttleCab(command, size) : 0;
+      if (cab>0 && !newest(cab, sequence, sender, port)) staleCommands++;
+      else udpCommands+=CommandDistributor::parse(UDP_CLIENT_ID, command, size, udpRing);
+      command+=size;
+      length-=size;
+    }
+    udpRing->commit();
+    // nothing carries over to the next datagram, which may be from someone else,
+    // and broadcasts have nowhere to go
+    CommandDistributor::forget(udpRing, UDP_CLIENT_ID);
+
+    if (udpRing->readHeader(length)>=0) {
+      udp->beginPacket(udp->remoteIP(), port);
+      udpRing->writeTo(udp, length);
+      udp->endPacket();
+    }
+    return true;
+}
+
+// Is this sequence number at least as new as the last applied to the cab?
+bool EthernetInterface::newest(int cab, uint16_t sequence, uint32_t sender, uint16_t port)
+{
+    UDP_CAB_SEQUENCE * entry=NULL;
+    UDP_CAB_SEQUENCE * oldest=NULL;
+    for (byte i=0;i<MAX_UDP_CABS;i++) {
+      UDP_CAB_SEQUENCE * e=&cabSequences[i];
+      if (e->cab==cab) {
+        entry=e;
+        break;
+      }
+      if (!oldest || (oldest->cab && (e->cab==0 || millis()-e->lastMillis > millis()-oldest->lastMillis))) oldest=e;
     }
+    // a different sender, or one that has gone quiet, starts a new sequence  
+    if (entry && entry->sender==sender && entry->senderPort==port
+        && millis()-entry->lastMillis < UDP_SEQUENCE_MILLIS
+        && (int16_t)(sequence-entry->sequence) < 0) return false;
+    if (!entry) entry=oldest;
+    entry->cab=cab;
+    entry->sequence=sequence;
+    entry->sender=sender;
+    entry->senderPort=port;
+    entry->lastMillis=millis();
+    return true;
+}
+#endif
+
+void EthernetInterface::displayStats(Print * stream)
+{
+    if (!singleton) {
+      StringFormatter::send(stream, F("\nEthernet not running\n"));
+      return;
+    }
+    StringFormatter::send(stream, F("\nEthernet passes=%l over budget=%l next socket=%d client sockets=%d idle closed=%l evicted=%l\n"),
+                          singleton->passes, singleton->passesCut, singleton->nextSocket, singleton->clientSockets,
+                          singleton->idleClosed, singleton->evicted);
+    for (byte socket = 0; socket < MAX_SOCK_NUM; socket++) {
+      if (!singleton->clients[socket]) continue;
+      ETHERNET_SOCKET_STATS * st=&singleton->stats[socket];
+      StringFormatter::send(stream, F("Socket %d in=%l out=%l commands=%l replies=%l latency avg=%lus max=%lus idle %ls\n"),
+                            socket, st->bytesIn, st->bytesOut, st->commands, st->replies,
+                            st->timed ? st->totalLatency/st->timed : 0UL, st->maxLatency,
+                            (millis()-st->lastMillis)/1000);
+    }
+#ifdef UDP_PORT
+    StringFormatter::send(stream, F("UDP port %d datagrams=%l commands=%l stale=%l dropped=%l\n"),
+                          UDP_PORT, singleton->datagrams, singleton->udpCommands,
+                          singleton->staleCommands, singleton->udpDropped);
+#endif
+#if Z21_ON == true
+    Z21Server::displayStats(stream);
+#endif
 }
 #endif
@@ -41,6 +41,42 @@
 #define LISTEN_PORT 2560                                        // default listen port for the server 
 #define MAX_ETH_BUFFER 512
 #define OUTBOUND_RING_SIZE 2048
+#define OUTBOUND_RING_RESERVE 256   // stop reading commands when the replies have less room than this 
+#define ETHERNET_LOOP_BUDGET 2000   // micros loop() may spend on sockets before the rest wait for the next pass 
+#ifndef ETHERNET_IDLE_SECONDS
+#define ETHERNET_IDLE_SECONDS 0     // close clients silent this long, 0 never 
+#endif
+#ifndef ETHERNET_EVICT_SECONDS
+#define ETHERNET_EVICT_SECONDS 0    // when the sockets run out, the client silent longest goes if quiet this long, 0 never 
+#endif
+
+#ifdef UDP_PORT
+#define UDP_RING_SIZE 512
+#define MAX_UDP_CABS 8
+#define UDP_SEQUENCE_MILLIS 5000   // a cab's sequence number is forgotten after this long 
+
+// Newest sequence number applied to a cab's speed by UDP
+struct UDP_CAB_SEQUENCE {
+  uint16_t cab;       // 0 if unused 
+  uint16_t sequence;
+  uint32_t sender;    // ip address 
+  uint16_t senderPort;
+  unsigned long lastMillis;
+};
+#endif
+
+struct ETHERNET_SOCKET_STATS {
+  unsigned long bytesIn;
+  unsigned long bytesOut;
+  unsigned long commands;
+  unsigned long replies;
+  unsigned long timed;          // replies with a latency measured 
+  unsigned long totalLatency;   // micros from reading a command to sending its reply 
+  unsigned long maxLatency;
+  unsigned long readMicros;     // when the command waiting for a reply was read 
+  unsigned long lastMillis;     // when the client last sent something 
+  bool waiting;
+};
 
 class EthernetInterface {
 
@@ -48,17 +84,43 @@ class EthernetInterface {
      
      static void setup();       
      static void loop();
+     static void displayStats(Print * stream);  // <D ETHERNET>
    
  private:
      static EthernetInterface * singleton;
      bool connected;
      EthernetInterface();
      void loop2();
+     bool readSocket(byte socket);
+     bool sendReply();
+     void closeSocket(byte socket, const __FlashStringHelper * why);
+     void checkIdle();
+     byte quietestSocket();
     EthernetServer * server;
     EthernetClient clients[MAX_SOCK_NUM];                // accept up to MAX_SOCK_NUM client connections at the same time; This depends on the chipset used on the Shield
     uint8_t buffer[MAX_ETH_BUFFER+1];                    // buffer used by TCP for the recv
     RingStream * outboundRing;
-  
+    byte nextSocket;   // where the next pass starts reading 
+    byte clientSockets;   // chip sockets left for TCP clients, one of them listening 
+    ETHERNET_SOCKET_STATS stats[MAX_SOCK_NUM];
+    int staleReplies[MAX_SOCK_NUM];   // replies queued before the socket was closed, dropped unsent 
+    unsigned long passes;
+    unsigned long passesCut;   // passes that ran out of budget 
+    unsigned long lastIdleCheck;
+    unsigned long idleClosed;
+    unsigned long evicted;
+#ifdef UDP_PORT
+    static const byte UDP_CLIENT_ID=0;
+    EthernetUDP * udp;
+    RingStream * udpRing;
+    UDP_CAB_SEQUENCE cabSequences[MAX_UDP_CABS];
+    bool readDatagram();
+    bool newest(int cab, uint16_t sequence, uint32_t sender, uint16_t port);
+    unsigned long datagrams;
+    unsigned long udpCommands;
+    unsigned long staleCommands;  // older than a speed already applied to the cab 
+    unsigned long udpDropped;     // too big for the buffer 
+#endif
 };
 
 #endif
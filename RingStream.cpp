@@ -20,55 +20,82 @@
 #include "RingStream.h"
 #include "DIAG.h"
 
-RingStream::RingStream( const uint16_t len)
+RingStream * RingStream::first=NULL;
+
+RingStream::RingStream( const uint16_t len, const __FlashStringHelper * name)
 {
-  _len=len;
-  _buffer=new byte[len];
+  _len=1;
+  while (_len*2 <= len) _len*=2;  // positions wrap by masking
+  _mask=_len-1;
+  _buffer=new byte[_len+1]; // +1 so there is always a byte after a span 
+  if (!_buffer) {
+    // no memory: a ring with no room, every message overflows  
+    _len=0;
+    _mask=0;
+  }
+  _name=name;
   _pos_write=0;
   _pos_read=0;
-  _buffer[0]=0;
+  _pos_committed=0;
+  if (_buffer) _buffer[0]=0;
   _overflow=false;
   _mark=0;
   _count=0; 
+  _messages=0;
+  _bytes=0;
+  _overflows=0;
+  _peak=0;
+  next=first;
+  first=this;
 }
 
 size_t RingStream::write(uint8_t b) {
   if (_overflow) return 0;
-  _buffer[_pos_write] = b;
-  ++_pos_write;
-  if (_pos_write==_len) _pos_write=0;
-  if (_pos_write==_pos_read) {
+  if (space()==0) {
     _overflow=true; 
     return 0;
   }
+  _buffer[_pos_write] = b;
+  _pos_write=(_pos_write+1) & _mask;
   _count++;
   return 1;
 }
 
-int RingStream::read() {
-  if ((_pos_read==_pos_write) && !_overflow) return -1;  // empty  
-  byte b=_buffer[_pos_read];
-  _pos_read++;
-  if (_pos_read==_len) _pos_read=0;
-  _overflow=false;
-  return b;
+size_t RingStream::write(const uint8_t * buffer, size_t size) {
+  if (_overflow) return 0;
+  if ((int)size > space()) {
+    _overflow=true;
+    return 0;
+  }
+  int beforeWrap=_len - _pos_write;
+  if ((int)size < beforeWrap) beforeWrap=size;
+  memcpy(_buffer+_pos_write, buffer, beforeWrap);
+  memcpy(_buffer, buffer+beforeWrap, size-beforeWrap);
+  _pos_write=(_pos_write+size) & _mask;
+  _count+=size;
+  return size;
 }
 
+byte * RingStream::writeSpan(int & length) {
+  int available= _overflow ? 0 : space();
+  if (available > _len - _pos_write) available=_len - _pos_write;
+  if (length > available) length=available;
+  return _buffer+_pos_write;
+}
 
-int RingStream::count() {
-  return (read()<<8) | read(); 
-  }
+void RingStream::wrote(int length) {
+  _pos_write=(_pos_write+length) & _mask;
+  _count+=length;
+}
 
 int RingStream::freeSpace() {
-  // allow space for client flag and length bytes
-  if (_pos_read>_pos_write) return _pos_read-_pos_write-3;
-  else return _len - _pos_write + _pos_read-3;  
+  return space() - HEADER_SIZE;
 }
 
-
 // mark start of message with client id (0...9)
 void RingStream::mark(uint8_t b) {
     _mark=_pos_write;
+    _overflow=false;
     write(b); // client id
     write((uint8_t)0);  // count MSB placemarker
     write((uint8_t)0);  // count LSB placemarker
@@ -77,10 +104,11 @@ void RingStream::mark(uint8_t b) {
 
 bool RingStream::commit() {
   if (_overflow) {
-        DIAG(F("\nRingStream(%d) commit(%d) OVERFLOW\n"),_len, _count);
         // just throw it away 
         _pos_write=_mark;
         _overflow=false;
+        _overflows++;
+        DIAG(F("\nRingStream %S commit(%d) OVERFLOW %d times\n"),_name, _count, _overflows);
         return false; // commit failed
   }
   if (_count==0) {
@@ -89,11 +117,59 @@ bool RingStream::commit() {
     return true; // true=commit ok
   }
   // Go back to the _mark and inject the count 1 byte later
-  _mark++;
-  if (_mark==_len) _mark=0;
-  _buffer[_mark]=highByte(_count);
-  _mark++;
-  if (_mark==_len) _mark=0;
-  _buffer[_mark]=lowByte(_count);
+  _buffer[(_mark+1) & _mask]=highByte(_count);
+  _buffer[(_mark+2) & _mask]=lowByte(_count);
+  _pos_committed=_pos_write;
+  _messages++;
+  _bytes+=_count;
+  if (used()>_peak) _peak=used();
   return true; // commit worked
 }
+
+int RingStream::peekHeader(int & length, int offset) {
+  if (offset >= ((_pos_committed - _pos_read) & _mask)) return -1;  // nothing committed to read 
+  int header=(_pos_read+offset) & _mask;
+  length=(_buffer[(header+1) & _mask]<<8) | _buffer[(header+2) & _mask];
+  return _buffer[header];
+}
+
+int RingStream::readHeader(int & length) {
+  int id=peekHeader(length);
+  if (id>=0) skip(HEADER_SIZE);
+  return id;
+}
+
+int RingStream::read() {
+  if (_pos_read==_pos_committed) return -1;  // empty  
+  byte b=_buffer[_pos_read];
+  _pos_read=(_pos_read+1) & _mask;
+  return b;
+}
+
+byte * RingStream::span(int & length) {
+  if (length > _len - _pos_read) length=_len - _pos_read;
+  return _buffer+_pos_read;
+}
+
+void RingStream::skip(int length) {
+  _pos_read=(_pos_read+length) & _mask;
+}
+
+void RingStream::writeTo(Print * stream, int count) {
+  while (count>0) {
+    int length=count;
+    byte * from=span(length);
+    stream->write(from,length);
+    skip(length);
+    count-=length;
+  }
+}
+
+void RingStream::printStats(Print * stream) {
+  StringFormatter::send(stream,F("\nRing %S size=%d messages=%l bytes=%l overflows=%d peak=%d\n"),
+                        _name, _len, _messages, _bytes, _overflows, _peak);
+}
+
+void RingStream::printAllStats(Print * stream) {
+  for (RingStream * ring=first; ring; ring=ring->next) ring->printStats(stream);
+}
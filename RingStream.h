@@ -21,27 +21,66 @@
 
 #include <Arduino.h>
   
+// A queue of framed messages, each one client id, 2 length bytes (high first) and the data.
+// Writers mark() a message, write to it and commit() it; an empty or overflowing 
+// message is rolled back. Readers take whole committed messages.
+// The size is a power of 2 so positions wrap by masking.
 class RingStream : public Print {
 
   public:
-    RingStream( const uint16_t len);
+    RingStream( const uint16_t len, const __FlashStringHelper * name);
+    bool ok() { return _buffer!=NULL; }  // false if there was no memory for the buffer 
   
+    // writing a message 
+    void mark(uint8_t b);
     virtual size_t write(uint8_t b);
+    virtual size_t write(const uint8_t * buffer, size_t size); // copied in at most 2 blocks
     using Print::write;
-    int read();
-    int count();
-    int freeSpace();
-    void mark(uint8_t b);
+    // Free space in place at the write position, length is cut down to what 
+    // fits before the buffer wraps. Bytes put there are added by wrote(). 
+    byte * writeSpan(int & length);
+    void wrote(int length);
     bool commit();
+    int freeSpace();   // data bytes a new message could hold
+    
+    // reading a message
+    // client id of the oldest message (-1 if none) and its data length,
+    // offset skips that many bytes of whole messages to look further down the queue
+    int peekHeader(int & length, int offset=0);
+    int readHeader(int & length);  // as peekHeader, then the data is ready to read 
+    int read();
+    // Unread bytes in place: returns where they start and cuts length down to 
+    // the part before the buffer wraps. The byte after the span may be
+    // overwritten temporarily (there is always one to spare).
+    byte * span(int & length);
+    void skip(int length);   // discard bytes already used through span()
+    void writeTo(Print * stream, int count); // read count bytes into stream in at most 2 blocks 
+
+    void printStats(Print * stream);
+    static void printAllStats(Print * stream);   // <D RINGS> 
+    static const byte HEADER_SIZE=3;  // client id and length 
 
  private:
+   static RingStream * first;
+   RingStream * next;
+   const __FlashStringHelper * _name;
    int _len;
+   int _mask;
    int _pos_write;
    int _pos_read;
+   int _pos_committed;  // end of the last committed message, readers stop here 
    bool _overflow;
    int _mark;
    int _count;
    byte * _buffer;
+   int used() { return (_pos_write - _pos_read) & _mask; }
+   int space() { return (_pos_read - _pos_write - 1) & _mask; }  // one byte always stays empty
+   
+   // statistics 
+   unsigned long _messages;
+   unsigned long _bytes;
+   unsigned int _overflows;
+   int _peak;
 };
 
 #endif
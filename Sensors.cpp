@@ -68,18 +68,18 @@ decide to ignore the <q ID> return and only react to <Q ID> triggers.
 #include "StringFormatter.h"
 #include "Sensors.h"
 #include "EEStore.h"
+#include "CommandDistributor.h"
 
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-// checks one defined sensors and prints _changed_ sensor state
-// to stream unless stream is NULL in which case only internal
-// state is updated. Then advances to next sensor which will
-// be checked att next invocation.
+// checks one defined sensors and publishes _changed_ sensor state
+// to all clients through the CommandDistributor. Then advances to
+// next sensor which will be checked att next invocation.
 //
 ///////////////////////////////////////////////////////////////////////////////
 
-void Sensor::checkAll(Print *stream){
+void Sensor::checkAll(){
 
   if (firstSensor == NULL) return;
   if (readingSensor == NULL) readingSensor=firstSensor;
@@ -90,8 +90,7 @@ void Sensor::checkAll(Print *stream){
     // no change
     if (readingSensor->latchdelay != 0) {
       // enable if you want to debug contact jitter
-      //if (stream != NULL) StringFormatter::send(stream, F("JITTER %d %d\n"), 
-      //                                          readingSensor->latchdelay, readingSensor->data.snum);
+      //DIAG(F("\nJITTER %d %d\n"), readingSensor->latchdelay, readingSensor->data.snum);
        readingSensor->latchdelay=0; // reset
     }
   } else if (readingSensor->latchdelay < 127) { // byte, max 255, good value unknown yet
@@ -101,7 +100,7 @@ void Sensor::checkAll(Print *stream){
     // make the change
     readingSensor->active = !sensorstate;
     readingSensor->latchdelay=0; // reset 
-    if (stream != NULL) StringFormatter::send(stream, F("<%c %d>"), readingSensor->active ? 'Q' : 'q', readingSensor->data.snum);
+    CommandDistributor::broadcastSensor(readingSensor);
   }
 
   readingSensor=readingSensor->nextSensor;
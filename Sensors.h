@@ -35,13 +35,14 @@ struct Sensor{
   SensorData data;
   boolean active;
   byte latchdelay;
+  bool broadcastPending; // changed since clients were last told
   Sensor *nextSensor;
   static void load();
   static void store();
   static Sensor *create(int, int, int);
   static Sensor* get(int);  
   static bool remove(int);  
-  static void checkAll(Print *);
+  static void checkAll();
   static void printAll(Print *);
 }; // Sensor
 
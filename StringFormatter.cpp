@@ -32,19 +32,26 @@
 #endif
 
 #include "LCDDisplay.h"
+#include "RingStream.h"
 
 bool Diag::ACK=false;
 bool Diag::CMD=false;
 bool Diag::WIFI=false;
 bool Diag::WITHROTTLE=false;
 bool Diag::ETHERNET=false;
+bool Diag::LOG=false;
+
+RingStream * StringFormatter::logRing=NULL;
+unsigned int StringFormatter::logDropped=0;
+bool StringFormatter::logBusy=false;
 
  
 void StringFormatter::diag( const __FlashStringHelper* input...) {
   if (!diagSerial) return;    
   va_list args;
   va_start(args, input);
-  send2(diagSerial,input,args);
+  if (Diag::LOG) logRecord(input,args);
+  else send2(diagSerial,input,args);
 }
 
 void StringFormatter::lcd(byte row, const __FlashStringHelper* input...) {
@@ -53,7 +60,8 @@ void StringFormatter::lcd(byte row, const __FlashStringHelper* input...) {
   // Issue the LCD as a diag first
   diag(F("\nLCD%d:"),row);
   va_start(args, input);
-  send2(diagSerial,input,args);
+  if (Diag::LOG) logRecord(input,args);
+  else send2(diagSerial,input,args);
   diag(F("\n"));
   
   if (!LCDDisplay::lcdDisplay) return;
@@ -77,12 +85,26 @@ void StringFormatter::send(Print & stream, const __FlashStringHelper* input...)
 void StringFormatter::send2(Print * stream,const __FlashStringHelper* format, va_list args) {
     
   // thanks to Jan Turoň  https://arduino.stackexchange.com/questions/56517/formatting-strings-in-arduino-for-output
+  // Literal text is gathered from flash and written in blocks rather than a char at a time.
 
   char* flash=(char*)format;
+  char literal[LITERAL_BLOCK];
+  byte literalLength=0;
   for(int i=0; ; ++i) {
     char c=pgm_read_byte_near(flash+i);
+    if (c!='%' && c!='\0') {
+      literal[literalLength++]=c;
+      if (literalLength==LITERAL_BLOCK) {
+        stream->write((uint8_t*)literal,literalLength);
+        literalLength=0;
+      }
+      continue;
+    }
+    if (literalLength) {
+      stream->write((uint8_t*)literal,literalLength);
+      literalLength=0;
+    }
     if (c=='\0') return;
-    if(c!='%') { stream->print(c); continue; }
 
     bool formatContinues=false;
     byte formatWidth=0;
@@ -93,8 +115,8 @@ void StringFormatter::send2(Print * stream,const __FlashStringHelper* format, va
     i++;
     c=pgm_read_byte_near(flash+i);
     switch(c) {
-      case '%': stream->print('%'); break;
-      case 'c': stream->print((char) va_arg(args, int)); break;
+      case '%': stream->write('%'); break;
+      case 'c': stream->write((char) va_arg(args, int)); break;
       case 's': stream->print(va_arg(args, char*)); break;
       case 'e': printEscapes(stream,va_arg(args, char*)); break;
       case 'E': printEscapes(stream,(const __FlashStringHelper*)va_arg(args, char*)); break;
@@ -150,7 +172,8 @@ void StringFormatter::printEscapes(Print * stream, const __FlashStringHelper * i
 }
 
 void StringFormatter::printEscape( char c) {
-  printEscape(diagSerial,c);
+  if (Diag::LOG) logChar(c);
+  else printEscape(diagSerial,c);
 }
 
 void StringFormatter::printEscape(Print * stream, char c) {
@@ -166,25 +189,145 @@ void StringFormatter::printEscape(Print * stream, char c) {
  }
 
  
+// Decimal conversion straight into a buffer, padded and written in one block.
+// Most values fit 16 bits, which the AVR divides far faster than 32.
 void StringFormatter::printPadded(Print* stream, long value, byte width, bool formatLeft) {
-  if (width==0) {
-    stream->print(value, DEC);
-    return;
+  char buffer[MAX_NUMBER_WIDTH];
+  byte end=sizeof(buffer);
+  byte pos=end;
+  bool negative=value<0;
+  unsigned long v= negative ? -(unsigned long)value : value;
+  if (v <= 0xFFFF) {
+    unsigned int v16=v;
+    do {
+      buffer[--pos]='0' + v16 % 10;
+      v16 /= 10;
+    } while (v16);
+  }
+  else do {
+    buffer[--pos]='0' + v % 10;
+    v /= 10;
+  } while (v);
+  if (negative) buffer[--pos]='-';
+
+  // pad on the side away from the number, within the buffer if there is room
+  byte digits=end-pos;
+  if (width>MAX_NUMBER_WIDTH-1) width=MAX_NUMBER_WIDTH-1;
+  if (formatLeft) {
+    memmove(buffer,buffer+pos,digits);
+    pos=0;
+    end=digits;
+    while (end<width) buffer[end++]=' ';
   }
+  else while (end-pos<width) buffer[--pos]=' ';
+  stream->write((uint8_t*)buffer+pos,end-pos);
+}
+
+bool StringFormatter::setLog(bool on) {
+  if (on && !logRing) logRing=new RingStream(LOG_RING,F("DIAG log"));
+  Diag::LOG= on && logRing && logRing->ok();
+  return Diag::LOG;
+}
+
+// Keep the arguments as they are, only %s needs copying because the string may be gone by the time it is drained 
+void StringFormatter::logRecord(const __FlashStringHelper* format, va_list args) {
+  if (logBusy) return;  // a DIAG from inside the log ring itself (overflow) 
+  logBusy=true;
+  logRing->mark(LOG_FORMAT);
+  logWord((uint16_t)(uintptr_t)format);
+  unsigned long now=micros();
+  logWord(now & 0xFFFF);
+  logWord(now >> 16);
   
-    int digits=(value <= 0)? 1: 0;  // zero and negative need extra digot
-    long v=value;
-    while (v) {
-        v /= 10;
-        digits++;
+  char* flash=(char*)format;
+  bool inFormat=false;
+  for (int i=0; ; ++i) {
+    char c=pgm_read_byte_near(flash+i);
+    if (c=='\0') break;
+    if (!inFormat) {
+      inFormat= c=='%';
+      continue;
     }
-    
-    if (formatLeft) stream->print(value, DEC);
-    while(digits<width) {
-      stream->print(' ');
-      digits++;
+    inFormat=false;
+    switch(c) {
+      case 'c': 
+      case 'd': 
+      case 'b': 
+      case 'o': 
+      case 'x': logWord(va_arg(args, int)); break;
+      case 'S': 
+      case 'E': logWord((uint16_t)(uintptr_t)va_arg(args, char*)); break;
+      case 'l': {
+          long value=va_arg(args, long);
+          logWord(value & 0xFFFF);
+          logWord(value >> 16);
+        }
+        break;
+      case 'f': {
+          float value=va_arg(args, double);
+          logRing->write((uint8_t*)&value,sizeof(value));
+        }
+        break;
+      case 's': 
+      case 'e': {
+          char * string=va_arg(args, char*);
+          byte length=0;
+          while (length<LOG_STRING_MAX && string[length]) length++;
+          logRing->write(length);
+          logRing->write((uint8_t*)string,length);
+        }
+        break;
+      case '-': 
+      case '0': 
+      case '1': 
+      case '2': 
+      case '3': 
+      case '4': 
+      case '5': 
+      case '6': 
+      case '7': 
+      case '8': 
+      case '9': inFormat=true; break; // width, the type follows
     }
-    if (!formatLeft) stream->print(value, DEC);    
   }
+  va_end(args);
+  if (!logRing->commit()) logDropped++;
+  logBusy=false;
+}
 
- 
+void StringFormatter::logChar(char c) {
+  if (logBusy) return;
+  logBusy=true;
+  logRing->mark(LOG_CHAR);
+  logRing->write(c);
+  if (!logRing->commit()) logDropped++;
+  logBusy=false;
+}
+
+void StringFormatter::logWord(uint16_t value) {
+  logRing->write(lowByte(value));
+  logRing->write(highByte(value));
+}
+
+// Drain as many records as diagSerial can take without waiting
+void StringFormatter::loop() {
+  if (!logRing || !diagSerial) return;
+  while (diagSerial->availableForWrite() >= LOG_DRAIN_SPACE) {
+    if (logDropped) {
+      diagSerial->write(LOG_FRAME_START);
+      diagSerial->write(LOG_DROPPED);
+      diagSerial->write(2);
+      diagSerial->write(lowByte(logDropped));
+      diagSerial->write(highByte(logDropped));
+      logDropped=0;
+      continue;
+    }
+    int length;
+    int type=logRing->readHeader(length);
+    if (type<0) return;
+    diagSerial->write(LOG_FRAME_START);
+    diagSerial->write(type);
+    diagSerial->write(length);
+    logRing->writeTo(diagSerial,length);
+  }
+}
@@ -28,6 +28,8 @@
 #endif
 
 #include "LCDDisplay.h"
+class RingStream;
+
 class Diag {
   public:
   static bool ACK;
@@ -35,6 +37,7 @@ class Diag {
   static bool WIFI;
   static bool WITHROTTLE;
   static bool ETHERNET;
+  static bool LOG;   // DIAG is recorded in binary and drained later, see StringFormatter::setLog
   
 };
 
@@ -55,9 +58,35 @@ class StringFormatter
     static void printEscapes(char * input);
     static void printEscape( char c);
 
+    // Deferred DIAG log. While on, DIAG keeps a compact record (format address, 
+    // micros and raw arguments) in RAM and loop() drains records to diagSerial 
+    // only when its transmit buffer has room. Decode the capture with diaglog.py
+    static bool setLog(bool on);
+    static void loop();
+    static unsigned int logDropped;  // records lost because the log ring was full
+
     private: 
     static void send2(Print * serial, const __FlashStringHelper* input,va_list args);
     static void printPadded(Print* stream, long value, byte width, bool formatLeft);
+    static const byte LITERAL_BLOCK=16;    // flash text copied per write 
+
+    static RingStream * logRing;
+    static bool logBusy;
+    static void logRecord(const __FlashStringHelper* input, va_list args);
+    static void logChar(char c);
+    static void logWord(uint16_t value);
+#ifdef ARDUINO_AVR_UNO
+    static const int LOG_RING=128;
+#else
+    static const int LOG_RING=512;
+#endif
+    static const byte LOG_FRAME_START=0x1E;  // ASCII record separator, then type, length, record 
+    static const byte LOG_FORMAT='F';        // format(2) micros(4) arguments
+    static const byte LOG_CHAR='C';          // one escaped char
+    static const byte LOG_DROPPED='X';       // count(2) of records lost
+    static const byte LOG_STRING_MAX=16;     // %s arguments are copied, truncated to this
+    static const byte LOG_DRAIN_SPACE=32;    // free transmit bytes needed before draining
+    static const byte MAX_NUMBER_WIDTH=16; // "-2147483648" plus padding
 
 };
 #endif
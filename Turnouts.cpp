@@ -22,6 +22,7 @@
 #include "EEStore.h"
 #include "PWMServoDriver.h"
 #include "StringFormatter.h"
+#include "CommandDistributor.h"
 #ifdef EESTOREDEBUG
 #include "DIAG.h"
 #endif
@@ -40,7 +41,6 @@ bool Turnout::activate(int n,bool state){
   if (tt==NULL) return false;
   tt->activate(state);
   EEStore::store();
-  turnoutlistHash++;
   return true;
 }
 
@@ -64,6 +64,7 @@ void Turnout::activate(bool state) {
   else
     DCC::setAccessory(data.address,data.subAddress, state);
   EEStore::store();
+  CommandDistributor::broadcastTurnout(this);
 }
 ///////////////////////////////////////////////////////////////////////////////
 
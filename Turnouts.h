@@ -39,6 +39,7 @@ class Turnout {
   static int turnoutlistHash;
   TurnoutData data;
   Turnout *nextTurnout;
+  bool broadcastPending; // changed since clients were last told, not stored in EEPROM
   static  bool activate(int n, bool state);
   static Turnout* get(int);
   static bool remove(int);
@@ -31,16 +31,15 @@
  *  Some shortcuts have been taken and there are some things that are yet to be included:
  *  e.g. Full response to adding a loco.
  *  What to do about unknown turnouts.
- *  Broadcasting to other WiThrottles when things change.  
- *    -  Bear in mind that changes may have taken place due to  
- *      other WiThrottles, OR JMRI commands received OR TPL automation. 
- *    - I suggest that at the end of parse(), then anything that has changed and is of interest could  
- *       be notified then.  (e.g loco speeds, directions or functions, turnout states.
+ *  Changes to loco speeds, directions, functions, turnout states and power are not replied to directly.
+ *    The CommandDistributor collects changes from all sources (other WiThrottles, JMRI commands, automation)
+ *    and calls broadcast() once per loop, each client is then sent what differs from what it was last told.   
  *       
- *  WiThrottle.h sets the max locos per client at 10, this is ok to increase but requires just an extra 3 bytes per loco per client.      
+ *  WiThrottle.h sets the max locos per client at 10, this is ok to increase but requires an extra 8 bytes per loco per client.      
 */
 #include <Arduino.h>
 #include "WiThrottle.h"
+#include "CommandDistributor.h"
 #include "DCC.h"
 #include "DCCWaveform.h"
 #include "StringFormatter.h"
@@ -55,10 +54,21 @@
 WiThrottle * WiThrottle::firstThrottle=NULL;
 bool WiThrottle::annotateLeftRight=false;
 
-WiThrottle* WiThrottle::getThrottle( int wifiClient) {
+WiThrottle* WiThrottle::getThrottle(RingStream * stream, int wifiClient) {
   for (WiThrottle* wt=firstThrottle; wt!=NULL ; wt=wt->nextThrottle)  
-     if (wt->clientid==wifiClient) return wt; 
-  return new WiThrottle( wifiClient);
+     if (wt->ring==stream && wt->clientid==wifiClient) return wt; 
+  return new WiThrottle(stream, wifiClient);
+}
+
+// The connection has gone, so a new client with this id starts afresh.
+// Its locos are left as they are, as when a client quits.
+void WiThrottle::forget(RingStream * stream, int wifiClient) {
+  for (WiThrottle* wt=firstThrottle; wt!=NULL ; wt=wt->nextThrottle)  
+     if (wt->ring==stream && wt->clientid==wifiClient) {
+       if (Diag::WITHROTTLE) DIAG(F("\n%l WiThrottle(%d) closed\n"),millis(),wifiClient);
+       delete wt;
+       return;
+     }
 }
 
 bool WiThrottle::isThrottleInUse(int cab) {
@@ -75,10 +85,11 @@ bool WiThrottle::areYouUsingThrottle(int cab) {
 }
  // One instance of WiThrottle per connected client, so we know what the locos are 
  
-WiThrottle::WiThrottle( int wificlientid) {
+WiThrottle::WiThrottle(RingStream * stream, int wificlientid) {
    if (Diag::WITHROTTLE) DIAG(F("\n%l Creating new WiThrottle for client %d\n"),millis(),wificlientid); 
    nextThrottle=firstThrottle;
    firstThrottle= this;
+   ring=stream;
    clientid=wificlientid;
    initSent=false; // prevent sending heartbeats before connection completed
    heartBeatEnable=false; // until client turns it on
@@ -87,6 +98,7 @@ WiThrottle::WiThrottle( int wificlientid) {
 }
 
 WiThrottle::~WiThrottle() {
+  CommandDistributor::throttleDeleted(ring, clientid);  // the session must not keep a pointer to us
   if (firstThrottle== this) {
     firstThrottle=this->nextThrottle;
     return;
@@ -107,12 +119,6 @@ void WiThrottle::parse(RingStream * stream, byte * cmdx) {
   if (Diag::WITHROTTLE) DIAG(F("\n%l WiThrottle(%d)<-[%e]\n"),millis(),clientid,cmd);
 
   if (initSent) {
-    // Send power state if different than last sent
-    bool currentPowerState = (DCCWaveform::mainTrack.getPowerMode()==POWERMODE::ON);
-    if (lastPowerState != currentPowerState) {
-      StringFormatter::send(stream,F("PPA%x\n"),currentPowerState);
-      lastPowerState = currentPowerState;  
-    }
     // Send turnout list if changed since last sent (will replace list on client)
     if (turnoutListHash != Turnout::turnoutlistHash) {
       StringFormatter::send(stream,F("PTL"));
@@ -132,9 +138,7 @@ void WiThrottle::parse(RingStream * stream, byte * cmdx) {
             break;
        case 'P':  
             if (cmd[1]=='P' && cmd[2]=='A' )  {  //PPA power mode 
-              DCCWaveform::mainTrack.setPowerMode(cmd[3]=='1'?POWERMODE::ON:POWERMODE::OFF);
-              StringFormatter::send(stream,F("PPA%x\n"),DCCWaveform::mainTrack.getPowerMode()==POWERMODE::ON);
-              lastPowerState = (DCCWaveform::mainTrack.getPowerMode()==POWERMODE::ON); //remember power state sent for comparison later
+              DCCWaveform::mainTrack.setPowerMode(cmd[3]=='1'?POWERMODE::ON:POWERMODE::OFF); // PPA is broadcast
             }
             else if (cmd[1]=='T' && cmd[2]=='A') { // PTA accessory toggle 
                 int id=getInt(cmd+4); 
@@ -152,8 +156,7 @@ void WiThrottle::parse(RingStream * stream, byte * cmdx) {
                     case 'C': newstate=false; break;
                     case '2': newstate=!Turnout::isActive(id);                 
                 }
-		            Turnout::activate(id,newstate);
-                StringFormatter::send(stream, F("PTA%c%d\n"),newstate?'4':'2',id );   
+		            Turnout::activate(id,newstate); // PTA is broadcast
             }
             break;
        case 'N':  // Heartbeat (2), only send if connection completed by 'HU' message
@@ -171,7 +174,6 @@ void WiThrottle::parse(RingStream * stream, byte * cmdx) {
               if (annotateLeftRight) StringFormatter::send(stream,F("PTT]\\[Turnouts}|{Turnout]\\[Left}|{2]\\[Right}|{4\n"));
               else                   StringFormatter::send(stream,F("PTT]\\[Turnouts}|{Turnout]\\[Closed}|{2]\\[Thrown}|{4\n"));
               StringFormatter::send(stream,F("PPA%x\n"),DCCWaveform::mainTrack.getPowerMode()==POWERMODE::ON);
-              lastPowerState = (DCCWaveform::mainTrack.getPowerMode()==POWERMODE::ON); //remember power state sent for comparison later
               StringFormatter::send(stream,F("*%d\n"),HEARTBEAT_SECONDS);
               initSent = true;
             }
@@ -239,6 +241,7 @@ void WiThrottle::multithrottle(RingStream * stream, byte * cmd){
                     StringFormatter::send(stream, F("M%cA%c%d<;>V%d\n"), throttleChar, cmd[3], locoid, DCCToWiTSpeed(DCC::getThrottleSpeed(locoid)));
                     StringFormatter::send(stream, F("M%cA%c%d<;>R%d\n"), throttleChar, cmd[3], locoid, DCC::getThrottleDirection(locoid));
                     StringFormatter::send(stream, F("M%cA%c%d<;>s1\n"), throttleChar, cmd[3], locoid); //default speed step 128
+                    rememberLoco(loco); // client is now up to date with this loco
                     return;
                   }
                }
@@ -263,22 +266,20 @@ void WiThrottle::locoAction(RingStream * stream, byte* aval, char throttleChar,
            case 'V':  // Vspeed
              { 
               int witSpeed=getInt(aval+1);
+              THROTTLE_SETTING settings[MAX_MY_LOCO];
+              byte count=0;
               LOOPLOCOS(throttleChar, cab) {
-                DCC::setThrottle(myLocos[loco].cab, WiTToDCCSpeed(witSpeed), DCC::getThrottleDirection(myLocos[loco].cab));
-                StringFormatter::send(stream,F("M%cA%c%d<;>V%d\n"), throttleChar, LorS(myLocos[loco].cab), myLocos[loco].cab, witSpeed);
+                settings[count++]={(uint16_t)myLocos[loco].cab, (uint8_t)WiTToDCCSpeed(witSpeed), DCC::getThrottleDirection(myLocos[loco].cab)};
                 }
+              DCC::setThrottles(settings,count); // whole consist in one call
              } 
             break;
            case 'F': //F onOff function
               {
-		            bool funcstate;
                 bool pressed=aval[1]=='1';
                 int fKey = getInt(aval+2);
                 LOOPLOCOS(throttleChar, cab) {
-		              funcstate = DCC::changeFn(myLocos[loco].cab, fKey, pressed);
-		              if(funcstate==0 || funcstate==1)
-			              StringFormatter::send(stream,F("M%cA%c%d<;>F%d%d\n"), throttleChar, LorS(myLocos[loco].cab), 
-						          myLocos[loco].cab, funcstate, fKey);
+		              DCC::changeFn(myLocos[loco].cab, fKey, pressed); // new state is broadcast
 		              }
                 }
                 break;  
@@ -297,25 +298,27 @@ void WiThrottle::locoAction(RingStream * stream, byte* aval, char throttleChar,
             case 'R':
             { 
               bool forward=aval[1]!='0';
+              THROTTLE_SETTING settings[MAX_MY_LOCO];
+              byte count=0;
               LOOPLOCOS(throttleChar, cab) {              
-                DCC::setThrottle(myLocos[loco].cab, DCC::getThrottleSpeed(myLocos[loco].cab), forward);
-                StringFormatter::send(stream,F("M%cA%c%d<;>R%d\n"), throttleChar, LorS(myLocos[loco].cab), myLocos[loco].cab, forward);
+                settings[count++]={(uint16_t)myLocos[loco].cab, DCC::getThrottleSpeed(myLocos[loco].cab), forward};
               }
+              DCC::setThrottles(settings,count);
             }        
             break;      
             case 'X':
               //Emergency Stop  (speed code 1)
-              LOOPLOCOS(throttleChar, cab) {
-                DCC::setThrottle(myLocos[loco].cab, 1, DCC::getThrottleDirection(myLocos[loco].cab));
-                StringFormatter::send(stream,F("M%cA%c%d<;>V%d\n"), throttleChar, LorS(myLocos[loco].cab), myLocos[loco].cab, -1);
-              }
-              break;
             case 'I': // Idle, set speed to 0
             case 'Q': // Quit, set speed to 0
+            {
+              THROTTLE_SETTING settings[MAX_MY_LOCO];
+              byte count=0;
+              bool eStop=aval[0]=='X';
               LOOPLOCOS(throttleChar, cab) {
-                DCC::setThrottle(myLocos[loco].cab, 0, DCC::getThrottleDirection(myLocos[loco].cab));
-                StringFormatter::send(stream,F("M%cA%c%d<;>V%d\n"), throttleChar, LorS(myLocos[loco].cab), myLocos[loco].cab, 0);
+                settings[count++]={(uint16_t)myLocos[loco].cab, (uint8_t)(eStop?1:0), DCC::getThrottleDirection(myLocos[loco].cab)};
               }
+              DCC::setThrottles(settings,count);
+            }
               break;
             }               
 }
@@ -334,31 +337,83 @@ int WiThrottle::WiTToDCCSpeed(int WiTSpeed) {
   return WiTSpeed + 1; //offset others by 1
 }
 
-void WiThrottle::loop(RingStream * stream) {
+void WiThrottle::loop() {
   // for each WiThrottle, check the heartbeat
-  for (WiThrottle* wt=firstThrottle; wt!=NULL ; wt=wt->nextThrottle) 
+  for (WiThrottle* wt=firstThrottle; wt!=NULL ; ) {
+     WiThrottle* next=wt->nextThrottle;  // checkHeartbeat may delete wt
      wt->checkHeartbeat();
+     wt=next;
+  }
 
-   // TODO... any broadcasts to be done 
-   (void)stream; 
-   /* MUST follow this model in  this loop. 
-    *   stream->mark();
-    *   send 1 digit client id, and any data 
-    *   stream->commit() 
+   // broadcasts are done by the CommandDistributor calling broadcast() 
+}
+
+// Called by the CommandDistributor when anything of interest has changed. 
+void WiThrottle::broadcast(bool locos, bool turnouts, bool power) {
+  for (WiThrottle* wt=firstThrottle; wt!=NULL ; wt=wt->nextThrottle) {
+    if (!wt->initSent) continue;
+    /* MUST follow this model 
+     *   stream->mark(client id);
+     *   send any data 
+     *   stream->commit() 
      */
+    wt->ring->mark(wt->clientid);
+    wt->sendChanges(wt->ring, locos, turnouts, power);
+    wt->ring->commit();
+  }
+}
 
+// Send this client anything that differs from what it was last told
+void WiThrottle::sendChanges(RingStream * stream, bool locos, bool turnouts, bool power) {
+  if (power) StringFormatter::send(stream,F("PPA%x\n"),DCCWaveform::mainTrack.getPowerMode()==POWERMODE::ON);
+  if (turnouts) {
+    for (Turnout *tt=Turnout::firstTurnout;tt!=NULL;tt=tt->nextTurnout)
+      if (tt->broadcastPending) 
+        StringFormatter::send(stream, F("PTA%c%d\n"), (tt->data.tStatus & STATUS_ACTIVE)?'4':'2', tt->data.id);
+  }
+  if (!locos) return;
+  LOOPLOCOS('*', -1) {
+    if (myLocos[loco].throttle=='\0') continue;
+    char throttleChar=myLocos[loco].throttle;
+    int cab=myLocos[loco].cab;
+    byte oldSpeedCode=myLocos[loco].speedCode;
+    unsigned long oldFunctions=myLocos[loco].functions;
+    rememberLoco(loco);
+    byte speedCode=myLocos[loco].speedCode;
+    if ((speedCode ^ oldSpeedCode) & 0x7F) 
+      StringFormatter::send(stream,F("M%cA%c%d<;>V%d\n"), throttleChar, LorS(cab), cab, DCCToWiTSpeed(speedCode & 0x7F));
+    if ((speedCode ^ oldSpeedCode) & 0x80) 
+      StringFormatter::send(stream,F("M%cA%c%d<;>R%d\n"), throttleChar, LorS(cab), cab, (speedCode & 0x80)!=0);
+    unsigned long changed=myLocos[loco].functions ^ oldFunctions;
+    for (byte fKey=0; changed; fKey++, changed>>=1) 
+      if (changed & 1) 
+        StringFormatter::send(stream,F("M%cA%c%d<;>F%d%d\n"), throttleChar, LorS(cab), cab, 
+                              (int)((myLocos[loco].functions>>fKey) & 1), fKey);
+  }
+}
+
+// Note the current DCC state of a loco as sent to this client
+void WiThrottle::rememberLoco(int loco) {
+  int cab;
+  if (!DCC::getLocoState(DCC::lookupLoco(myLocos[loco].cab), cab, myLocos[loco].speedCode, myLocos[loco].functions)) {
+    myLocos[loco].speedCode=0x80;  // not driven yet, stopped forward
+    myLocos[loco].functions=0;
+  }
 }
 
 void WiThrottle::checkHeartbeat() {
   // if eStop time passed... eStop any locos still assigned to this client and then drop the connection
   if(heartBeatEnable && (millis()-heartBeat > ESTOP_SECONDS*1000)) {
   if (Diag::WITHROTTLE)  DIAG(F("\n\n%l WiThrottle(%d) eStop(%ds) timeout, drop connection\n"), millis(), clientid, ESTOP_SECONDS);
+    THROTTLE_SETTING settings[MAX_MY_LOCO];
+    byte count=0;
     LOOPLOCOS('*', -1) { 
       if (myLocos[loco].throttle!='\0') {
         if (Diag::WITHROTTLE) DIAG(F("%l  eStopping cab %d\n"),millis(),myLocos[loco].cab);
-        DCC::setThrottle(myLocos[loco].cab, 1, DCC::getThrottleDirection(myLocos[loco].cab)); // speed 1 is eStop
+        settings[count++]={(uint16_t)myLocos[loco].cab, 1, DCC::getThrottleDirection(myLocos[loco].cab)}; // speed 1 is eStop
       }
     }
+    DCC::setThrottles(settings,count);
     delete this;
    }
 }
@@ -24,16 +24,20 @@
 struct MYLOCO {
     char throttle; //indicates which throttle letter on client, often '0','1' or '2'
     int cab; //address of this loco
+    byte speedCode; // DCC speed and direction last sent to client
+    unsigned long functions; // F0-F28 last sent to client
 };
 
 class WiThrottle {
   public:  
-    static void loop(RingStream * stream);
+    static void loop();
     void parse(RingStream * stream, byte * cmd);
-    static WiThrottle* getThrottle( int wifiClient); 
+    static WiThrottle* getThrottle(RingStream * stream, int wifiClient); 
+    static void forget(RingStream * stream, int wifiClient);  // client has disconnected
+    static void broadcast(bool locos, bool turnouts, bool power);
     static bool annotateLeftRight;
   private: 
-    WiThrottle( int wifiClientId);
+    WiThrottle(RingStream * stream, int wifiClientId);
     ~WiThrottle();
    
       static const int MAX_MY_LOCO=10;      // maximum number of locos assigned to a single client
@@ -47,6 +51,7 @@ class WiThrottle {
       static void setSendTurnoutList();
       bool areYouUsingThrottle(int cab);
       WiThrottle* nextThrottle;
+      RingStream * ring; // where replies and broadcasts for this client go
       int clientid;
        
       MYLOCO myLocos[MAX_MY_LOCO];   
@@ -54,12 +59,13 @@ class WiThrottle {
       unsigned long heartBeat;
       bool initSent; // valid connection established
       int turnoutListHash;  // used to check for changes to turnout list
-      bool lastPowerState;  // last power state sent to this client
       int DCCToWiTSpeed(int DCCSpeed);
       int WiTToDCCSpeed(int WiTSpeed);
       void multithrottle(RingStream * stream, byte * cmd);
       void locoAction(RingStream * stream, byte* aval, char throttleChar, int cab);
       void accessory(RingStream *, byte* cmd);
+      void sendChanges(RingStream * stream, bool locos, bool turnouts, bool power);
+      void rememberLoco(int loco);
       void checkHeartbeat();  
 };
 #endif
@@ -6,8 +6,8 @@
 
 WifiInboundHandler * WifiInboundHandler::singleton;
 
-void WifiInboundHandler::setup(Stream * ESStream) {
-  singleton=new WifiInboundHandler(ESStream);
+void WifiInboundHandler::setup(Stream * ESStream, long linkSpeed) {
+  singleton=new WifiInboundHandler(ESStream, linkSpeed);
 }
 
 void WifiInboundHandler::loop() {
@@ -15,68 +15,228 @@ void WifiInboundHandler::loop() {
 }
 
 
-WifiInboundHandler::WifiInboundHandler(Stream * ESStream) {
+WifiInboundHandler::WifiInboundHandler(Stream * ESStream, long speed) {
   wifiStream=ESStream;
+  linkSpeed=speed;
   clientPendingCIPSEND=-1;
-  inboundRing=new RingStream(INBOUND_RING);
-  outboundRing=new RingStream(OUTBOUND_RING);
+  inboundRing=new RingStream(INBOUND_RING,F("WiFi in"));
+  for (byte c=0;c<MAX_CLIENTS;c++) queues[c]={NULL,false,0,0,0,0,0,false};
+  nextQueue=0;
   pendingCipsend=false;
+  statsStartMillis=0;
+  cipsendCount=0;
+  cipsendsPerSecond=0;
+  rxCount=0;
+  txCount=0;
+  rxPerSecond=0;
+  txPerSecond=0;
+  cipsendTotal=0;
+  repliesSent=0;
+  bytesSent=0;
+  ipdMarked=false;
+  stalled=false;
+  stallStart=0;
+  ipdTotal=0;
+  ipdBytes=0;
+  stallCount=0;
+  stallTotal=0;
+  droppedIPDs=0;
+  droppedBytes=0;
+  readyMillis=millis();
+  firstPacketMillis=0;
 } 
 
+// The client's outbound queue, created the first time it is needed 
+WIFI_CLIENT_QUEUE * WifiInboundHandler::clientQueue(byte clientId) {
+  if (clientId>=MAX_CLIENTS) return NULL;
+  WIFI_CLIENT_QUEUE * queue=&queues[clientId];
+  if (!queue->ring) {
+    queue->ring=new RingStream(CLIENT_RING,F("WiFi client"));
+    if (!queue->ring || !queue->ring->ok()) DIAG(F("\nWifi: no memory for client %d queue\n"),clientId);
+  }
+  return (queue->ring && queue->ring->ok()) ? queue : NULL;
+}
 
 // Handle any inbound transmission
 // +IPD,x,lll:data is stored in streamer[x]
 // Other input returns  
 void WifiInboundHandler::loop1() {
    // First handle all inbound traffic events because they will block the sending 
-   if (loop2()!=INBOUND_IDLE) return;
+   INBOUND_STATE inbound=loop2();
+   if (inbound==INBOUND_BUSY) return;
 
-   WiThrottle::loop(outboundRing);
+   WiThrottle::loop();
+   noteQueued();
+   if (millis()-statsStartMillis >= 1000) {
+     cipsendsPerSecond=cipsendCount;
+     cipsendCount=0;
+     rxPerSecond=rxCount;
+     txPerSecond=txCount;
+     rxCount=0;
+     txCount=0;
+     statsStartMillis=millis();
+   }
    
-    // if nothing is already CIPSEND pending, we can CIPSEND one reply
-    if (clientPendingCIPSEND<0) {
-       clientPendingCIPSEND=outboundRing->read();
-       if (clientPendingCIPSEND>=0) {
-         currentReplySize=outboundRing->count();
-         pendingCipsend=true;
-       }
-     }
+    // if nothing is already CIPSEND pending, the next client in turn can CIPSEND 
+    // everything it has waiting. Not while inbound data is stalled, the ESP's reply 
+    // would be stuck behind it.
+    if (inbound==INBOUND_IDLE && clientPendingCIPSEND<0) {
+      for (byte i=0;i<MAX_CLIENTS;i++) {
+        byte c=(nextQueue+i) % MAX_CLIENTS;
+        if (!queues[c].ring) continue; 
+        // leave the replies in the ring until the ESP asks for them with '>'
+        currentReplySize=mergedReplySize(queues[c].ring);
+        if (currentReplySize==0) continue;
+        clientPendingCIPSEND=c;
+        pendingCipsend=true;
+        nextQueue=c+1;
+        break;
+      }
+    }
     
 
-    if (pendingCipsend) {
+    if (inbound==INBOUND_IDLE && pendingCipsend) {
          if (Diag::WIFI) DIAG( F("\nWiFi: [[CIPSEND=%d,%d]]"), clientPendingCIPSEND, currentReplySize);
          StringFormatter::send(wifiStream, F("AT+CIPSEND=%d,%d\r\n"),  clientPendingCIPSEND, currentReplySize);
          pendingCipsend=false;
+         cipsendCount++;
+         // AT+CIPSEND=c,n\r\n 
+         txCount+=15 + (currentReplySize>=10) + (currentReplySize>=100) + (currentReplySize>=1000);
+         cipsendTotal++;
          return;
       }
     
     
     // if something waiting to execute, we can call it 
-      int clientId=inboundRing->read();
+      int count;
+      int clientId=inboundRing->peekHeader(count);
       if (clientId>=0) {
-         int count=inboundRing->count();
-         if (Diag::WIFI) DIAG(F("\nWifi EXEC: %d %d:"),clientId,count); 
-         byte cmd[count+1];
-         for (int i=0;i<count;i++) cmd[i]=inboundRing->read();   
-         cmd[count]=0;
-         if (Diag::WIFI) DIAG(F("%e\n"),cmd); 
+         WIFI_CLIENT_QUEUE * queue=clientQueue(clientId);
+         // hold the command back until the client has taken some of its replies,
+         // unless +IPD data is stalled behind it or other clients' commands are waiting 
+         // behind it: better this client loses a reply than anyone waits for it. 
+         if (queue && inbound==INBOUND_IDLE && queue->ring->freeSpace() < CLIENT_RING_RESERVE
+             && !otherClientWaiting(clientId)) return;
+         inboundRing->readHeader(count);
+         if (!queue) {
+           inboundRing->skip(count);
+           return;
+         }
+         if (Diag::WIFI) DIAG(F("\nWifi EXEC: %d %d\n"),clientId,count); 
          
+         RingStream * outboundRing=queue->ring;
          outboundRing->mark(clientId);  // remember start of outbound data 
-         CommandDistributor::parse(clientId,cmd,outboundRing);
+         // parse in place from the ring, in two parts if the data wraps round the end
+         while (count>0) {
+           int length=count;
+           byte * segment=inboundRing->span(length);
+           CommandDistributor::parse(clientId,segment,length,outboundRing);
+           inboundRing->skip(length);
+           count-=length;
+         }
          // The commit call will either write the lenbgth bytes 
          // OR rollback to the mark because the reply is empty or commend generated more than fits the buffer 
          outboundRing->commit();
+         if (queue->lossPending && --queue->lossAfter==0) {
+           queue->lossPending=false;
+           CommandDistributor::lostInput(outboundRing, clientId);
+         }
          return;
       }
    }
 
+// True if the inbound ring holds commands from any client but this one 
+bool WifiInboundHandler::otherClientWaiting(byte clientId) {
+  int offset=0;
+  int length;
+  int id;
+  while ((id=inboundRing->peekHeader(length,offset))>=0) {
+    if (id!=clientId) return true;
+    offset+=RingStream::HEADER_SIZE+length;
+  }
+  return false;
+}
+
+// The replies waiting for a client that fit in one CIPSEND 
+int WifiInboundHandler::mergedReplySize(RingStream * ring) {
+  int size=0;
+  int offset=0;
+  int length;
+  while (ring->peekHeader(length,offset)>=0 && size+length<=MAX_CIPSEND) {
+    size+=length;
+    offset+=RingStream::HEADER_SIZE+length;
+  }
+  return size;
+}
+
+// Take the currentReplySize bytes of replies for clientPendingCIPSEND from its queue, 
+// they go to stream unless it is NULL  
+void WifiInboundHandler::takeReply(Stream * stream) {
+  RingStream * outboundRing=queues[clientPendingCIPSEND].ring;
+  int count;
+  for (int size=currentReplySize; size>0; size-=count) {
+    outboundRing->readHeader(count);
+    repliesSent++;
+    for (int remaining=count; remaining>0;) {
+      int length=remaining;
+      byte * reply=outboundRing->span(length);
+      if (stream) stream->write(reply,length);
+      if (stream && Diag::WIFI) for (int i=0;i<length;i++) StringFormatter::printEscape(reply[i]); // DIAG in disguise
+      outboundRing->skip(length);
+      remaining-=length;
+    }
+  }
+}
+
+// Start the latency clock for any queue that has a reply waiting 
+void WifiInboundHandler::noteQueued() {
+  for (byte c=0;c<MAX_CLIENTS;c++) {
+    WIFI_CLIENT_QUEUE * queue=&queues[c];
+    int length;
+    if (queue->ring && !queue->waiting && queue->ring->peekHeader(length)>=0) {
+      queue->waiting=true;
+      queue->queuedSince=millis();
+    }
+  }
+}
+
+void WifiInboundHandler::displayStats(Print * stream) {
+  if (!singleton) return;
+  StringFormatter::send(stream,F("\nWiFi CIPSENDs=%l (%d/sec) replies=%l bytes=%l, %l bytes/CIPSEND"),
+                        singleton->cipsendTotal, singleton->cipsendsPerSecond, singleton->repliesSent, 
+                        singleton->bytesSent, singleton->cipsendTotal ? singleton->bytesSent/singleton->cipsendTotal : 0UL);
+  StringFormatter::send(stream,F("\nWiFi +IPDs=%l bytes=%l stalls=%l (%lms) dropped=%l +IPDs %l bytes"),
+                        singleton->ipdTotal, singleton->ipdBytes, singleton->stallCount, singleton->stallTotal,
+                        singleton->droppedIPDs, singleton->droppedBytes);
+  // each way the link carries a byte for every 10 bits 
+  StringFormatter::send(stream,F("\nWiFi link %l baud, last second in=%l out=%l bytes, %d%%/%d%% used"),
+                        singleton->linkSpeed, singleton->rxPerSecond, singleton->txPerSecond,
+                        (int)(singleton->rxPerSecond*1000/singleton->linkSpeed), 
+                        (int)(singleton->txPerSecond*1000/singleton->linkSpeed));
+  StringFormatter::send(stream,F("\nWiFi ready %lms after boot, first packet after %lms"),
+                        singleton->readyMillis, singleton->firstPacketMillis);
+  for (byte c=0;c<MAX_CLIENTS;c++) {
+    WIFI_CLIENT_QUEUE * queue=&singleton->queues[c];
+    if (!queue->ring) continue;
+    StringFormatter::send(stream,F("\nWiFi client %d CIPSENDs=%l wait avg=%lms max=%lms"),
+                          c, queue->sent, queue->sent ? queue->totalWait/queue->sent : 0UL, queue->maxWait);
+    queue->ring->printStats(stream);
+  }
+}
+
 
 
 // This is a Finite State Automation (FSA) handling the inbound bytes from an ES AT command processor    
 
 WifiInboundHandler::INBOUND_STATE WifiInboundHandler::loop2() {
+  if (loopState==IPD_DATA && !readIPD()) return INBOUND_STALLED;
   while (wifiStream->available()) {
+    if (loopState==IPD_DATA) {
+      if (!readIPD()) return INBOUND_STALLED;
+      continue;
+    }
     int ch = wifiStream->read();
+    rxCount++;
 
     // echo the char to the diagnostic stream in escaped format
     if (Diag::WIFI) {
@@ -92,13 +252,17 @@ WifiInboundHandler::INBOUND_STATE WifiInboundHandler::loop2() {
           break; 
         }
         
-        if (ch=='>') { 
+        if (ch=='>' && clientPendingCIPSEND>=0) { 
            if (Diag::WIFI) DIAG(F("[XMIT %d]"),currentReplySize); 
-           for (int i=0;i<currentReplySize;i++) {
-             int cout=outboundRing->read();
-             wifiStream->write(cout);
-             if (Diag::WIFI) StringFormatter::printEscape(cout); // DIAG in disguise
-           }
+           WIFI_CLIENT_QUEUE * queue=&queues[clientPendingCIPSEND];
+           takeReply(wifiStream);
+           bytesSent+=currentReplySize;
+           txCount+=currentReplySize;
+           unsigned long wait=millis()-queue->queuedSince;
+           queue->sent++;
+           queue->totalWait+=wait;
+           if (wait>queue->maxWait) queue->maxWait=wait;
+           queue->waiting=false;  // noteQueued restarts the clock if there is more 
            clientPendingCIPSEND=-1;
            pendingCipsend=false;
            loopState=SKIPTOEND;
@@ -155,7 +319,7 @@ WifiInboundHandler::INBOUND_STATE WifiInboundHandler::loop2() {
         break;
         
       case IPD4_CLIENT:  // reading connection id
-        if (ch >= '0' || ch <='9'){
+        if (ch >= '0' && ch <='9'){
            runningClientId=ch-'0';
            loopState=IPD5;
         }
@@ -173,30 +337,32 @@ WifiInboundHandler::INBOUND_STATE WifiInboundHandler::loop2() {
             loopState=ANYTHING;
             break;
           }
+          if (!firstPacketMillis) {
+            firstPacketMillis=millis();
+            DIAG(F("\nWifi first packet %lms after boot\n"),firstPacketMillis);
+          }
           if (Diag::WIFI) DIAG(F("\nWifi inbound data(%d:%d):"),runningClientId,dataLength); 
-          if (inboundRing->freeSpace()<=(dataLength+1)) {
-            // This input would overflow the inbound ring, ignore it  
+          ipdTotal++;
+          ipdBytes+=dataLength;
+          if (runningClientId<MAX_CLIENTS && queues[runningClientId].lossPending) {
+            // not until the parser has been told of the last gap 
+            droppedIPDs++;
+            droppedBytes+=dataLength;
             loopState=IPD_IGNORE_DATA;
-            if (Diag::WIFI) DIAG(F("\nWifi OVERFLOW IGNORING:"));    
             break;
           }
-          inboundRing->mark(runningClientId);
+          ipdMarked=false;
           loopState=IPD_DATA;
+          if (!readIPD()) return INBOUND_STALLED;
           break; 
         }
         dataLength = dataLength * 10 + (ch - '0');
         break;
         
-      case IPD_DATA: // reading data
-        inboundRing->write(ch);    
-        dataLength--;
-        if (dataLength == 0) {
-          inboundRing->commit();    
-          loopState = ANYTHING;
-        }
+      case IPD_DATA: // taken by readIPD() before a char is read
         break;
-
-      case IPD_IGNORE_DATA: // ignoring data that would not fit in inbound ring
+        
+      case IPD_IGNORE_DATA: // ignoring data there was no room for
         dataLength--;
         if (dataLength == 0) loopState = ANYTHING;
         break;
@@ -209,6 +375,8 @@ WifiInboundHandler::INBOUND_STATE WifiInboundHandler::loop2() {
         if (ch=='C') {
          // got "x C" before CLOSE or CONNECTED, or CONNECT FAILED
          if (runningClientId==clientPendingCIPSEND) purgeCurrentCIPSEND();
+         // either way, nothing queued for the previous user of this id may go to the next one
+         purgeClient(runningClientId);
         }
         loopState=SKIPTOEND;   
         break;
@@ -221,10 +389,102 @@ WifiInboundHandler::INBOUND_STATE WifiInboundHandler::loop2() {
   return (loopState==ANYTHING) ? INBOUND_IDLE: INBOUND_BUSY;
 }
 
+// Copy the +IPD data that has arrived straight into the inbound ring. 
+// Data that doesn't fit is committed in parts, the command parser puts back together
+// any command split between them. While the ring is full the data is left in the
+// serial buffer for the commands already in the ring to run: returns false to say so.
+bool WifiInboundHandler::readIPD() {
+  while (dataLength>0) {
+    if (!ipdMarked) {
+      if (inboundRing->freeSpace() < min(dataLength, MIN_IPD_PART)) return waitForRoom();
+      if (stalled) {
+        stalled=false;
+        stallTotal+=millis()-stallStart;
+      }
+      inboundRing->mark(runningClientId);
+      ipdMarked=true;
+    }
+    int available=wifiStream->available();
+    if (available==0) return true;  // the rest is still to come 
+    int length=dataLength;
+    byte * data=inboundRing->writeSpan(length);
+    if (length==0) {  // full, let what is there run 
+      inboundRing->commit();
+      ipdMarked=false;
+      continue;
+    }
+    if (length>available) length=available;
+    // a plain read loop, Stream::readBytes would check its timeout for every byte
+    for (int i=0;i<length;i++) data[i]=wifiStream->read();
+    rxCount+=length;
+    if (Diag::WIFI) for (int i=0;i<length;i++) StringFormatter::printEscape(data[i]); // DIAG in disguise
+    inboundRing->wrote(length);
+    dataLength-=length;
+  }
+  inboundRing->commit();
+  ipdMarked=false;
+  loopState=ANYTHING;
+  return true;
+}
+
+// There is no flow control on the ESP link, so data can only be left waiting 
+// while the serial buffer has room for what comes next.
+bool WifiInboundHandler::waitForRoom() {
+  if (!stalled) {
+    stalled=true;
+    stallStart=millis();
+    stallCount++;
+  }
+  if (wifiStream->available() < RX_STALL_LIMIT && millis()-stallStart < MAX_STALL_MILLIS) return false;
+  if (Diag::WIFI) DIAG(F("\nWifi OVERFLOW IGNORING %d:"),dataLength);
+  stalled=false;
+  stallTotal+=millis()-stallStart;
+  droppedIPDs++;
+  droppedBytes+=dataLength;
+  loopState=IPD_IGNORE_DATA;
+  noteLoss(runningClientId);
+  return true;
+}
+
+// The parser must hear of the gap once it has run the parts already in the ring,
+// the client's +IPDs are dropped until then so there is only ever one gap to tell of.
+void WifiInboundHandler::noteLoss(byte clientId) {
+  WIFI_CLIENT_QUEUE * queue=clientQueue(clientId);
+  if (!queue) return;
+  int offset=0;
+  int length;
+  int id;
+  byte before=0;
+  while ((id=inboundRing->peekHeader(length,offset))>=0) {
+    if (id==clientId) before++;
+    offset+=RingStream::HEADER_SIZE+length;
+  }
+  if (before==0) {
+    queue->lossPending=false;
+    CommandDistributor::lostInput(queue->ring, clientId);
+    return;
+  }
+  queue->lossAfter=before;
+  queue->lossPending=true;
+}
+
 void WifiInboundHandler::purgeCurrentCIPSEND() {
          // A CIPSEND was sent but errored... or the client closed just toss it away
          if (Diag::WIFI) DIAG(F("Wifi: DROPPING CIPSEND=%d,%d\n"),clientPendingCIPSEND,currentReplySize);
-         for (int i=0;i<=currentReplySize;i++) outboundRing->read();
+         takeReply(NULL);
+         queues[clientPendingCIPSEND].waiting=false;
          pendingCipsend=false;  
          clientPendingCIPSEND=-1;
 }
+
+// Connection closed or opened: drop its queued replies and stop its broadcasts 
+void WifiInboundHandler::purgeClient(byte clientId) {
+  if (clientId>=MAX_CLIENTS) return;
+  WIFI_CLIENT_QUEUE * queue=&queues[clientId];
+  if (!queue->ring) return;
+  int count;
+  while (queue->ring->readHeader(count)>=0) queue->ring->skip(count);
+  queue->waiting=false;
+  queue->lossPending=false;
+  CommandDistributor::forget(queue->ring, clientId);
+}
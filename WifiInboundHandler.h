@@ -5,10 +5,25 @@
 #include "WiThrottle.h"
 #include "DIAG.h"
 
+// Each client has its own outbound queue so one big reply can't hold up the others.
+// Queues take turns to CIPSEND one reply each, and a client's next command
+// waits while its queue is nearly full, unless another client's commands are behind it. 
+struct WIFI_CLIENT_QUEUE {
+  RingStream * ring;          // NULL until the client first sends something
+  bool waiting;               // a reply is at the head of the queue
+  unsigned long queuedSince;  // millis when it got there
+  unsigned long sent;         // CIPSENDs for this client
+  unsigned long totalWait;    // millis replies spent at the head of the queue
+  unsigned long maxWait;
+  byte lossAfter;             // commands to run before the parser is told of dropped +IPD data
+  bool lossPending;
+};
+
 class WifiInboundHandler {
  public:  
-   static void setup(Stream * ESStream);
+   static void setup(Stream * ESStream, long linkSpeed);
    static void loop();
+   static void displayStats(Print * stream);  // <D WIFI> 
    
    private:
 
@@ -17,7 +32,8 @@ class WifiInboundHandler {
    
    enum INBOUND_STATE {
         INBOUND_BUSY,     // keep calling in loop() 
-        INBOUND_IDLE     // Nothing happening, outbound may xcall CIPSEND
+        INBOUND_IDLE,    // Nothing happening, outbound may xcall CIPSEND
+        INBOUND_STALLED  // +IPD data waiting for room, commands may run to make it
    };      
 
         enum LOOP_STATE {
@@ -33,24 +49,69 @@ class WifiInboundHandler {
           IPD5,        // got +IPD,c 
           IPD6_LENGTH, // got +IPD,c, reading length 
           IPD_DATA,    // got +IPD,c,ll,: collecting data
-          IPD_IGNORE_DATA, // got +IPD,c,ll,: ignoring the data that won't fit inblound Ring
+          IPD_IGNORE_DATA, // got +IPD,c,ll,: ignoring the data there was no room for
 
           GOT_CLIENT_ID,  // clientid prefix to CONNECTED / CLOSED
           GOT_CLIENT_ID2  // clientid prefix to CONNECTED / CLOSED
   };
 
   
-   WifiInboundHandler(Stream * ESStream);
+   WifiInboundHandler(Stream * ESStream, long linkSpeed);
    void loop1();
    INBOUND_STATE loop2();
    void purgeCurrentCIPSEND();
+   bool readIPD();
+   bool waitForRoom();
+   bool otherClientWaiting(byte clientId);
+   void noteLoss(byte clientId);
    Stream * wifiStream;
    
    static const int INBOUND_RING = 512;
-   static const int OUTBOUND_RING = 2048;
+   static const byte MAX_CLIENTS = 5;          // connections the ESP AT firmware allows
+   static const int CLIENT_RING = 512;         // outbound queue for each client 
+   static const int CLIENT_RING_RESERVE = 128; // client commands wait for this much space 
  
+   static const int MIN_IPD_PART = 16;         // don't split +IPD data into smaller parts than this 
+#ifdef SERIAL_RX_BUFFER_SIZE
+   static const int RX_STALL_LIMIT = SERIAL_RX_BUFFER_SIZE/2;  // stalled data may fill the serial buffer this far 
+#else
+   static const int RX_STALL_LIMIT = 32;
+#endif
+   static const unsigned long MAX_STALL_MILLIS = 100;
+   
    RingStream * inboundRing;
-   RingStream * outboundRing;
+   bool ipdMarked;            // some of the +IPD data is in an uncommitted message 
+   bool stalled;
+   unsigned long stallStart;
+   WIFI_CLIENT_QUEUE queues[MAX_CLIENTS];
+   byte nextQueue;   // where the round robin looks first
+   WIFI_CLIENT_QUEUE * clientQueue(byte clientId);
+   void noteQueued();
+   void purgeClient(byte clientId);
+   static const int MAX_CIPSEND = 2048;   // most the ESP takes in one AT+CIPSEND 
+   int mergedReplySize(RingStream * ring);
+   void takeReply(Stream * stream);
+   
+   // statistics 
+   unsigned long statsStartMillis;
+   int cipsendCount;        // in this second 
+   int cipsendsPerSecond;   // in the last second 
+   unsigned long linkSpeed;     // baud 
+   unsigned long rxCount;       // bytes on the link in this second 
+   unsigned long txCount;
+   unsigned long rxPerSecond;   // in the last second 
+   unsigned long txPerSecond;
+   unsigned long cipsendTotal;
+   unsigned long repliesSent; 
+   unsigned long bytesSent;
+   unsigned long ipdTotal;
+   unsigned long ipdBytes;
+   unsigned long stallCount;
+   unsigned long stallTotal;   // millis 
+   unsigned long droppedIPDs;
+   unsigned long droppedBytes;
+   unsigned long readyMillis;        // boot to the end of WiFi setup  
+   unsigned long firstPacketMillis;  // boot to the first +IPD, 0 until then 
      
   LOOP_STATE loopState=ANYTHING;
   int runningClientId;   // latest client inbound processing data or CLOSE
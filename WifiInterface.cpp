@@ -30,15 +30,33 @@ const char  PROGMEM OK_SEARCH[] = "\r\nOK\r\n";
 const char  PROGMEM END_DETAIL_SEARCH[] = "@ 1000";
 const char  PROGMEM SEND_OK_SEARCH[] = "\r\nSEND OK\r\n";
 const char  PROGMEM IPD_SEARCH[] = "+IPD";
+const char  PROGMEM GOT_IP_SEARCH[] = "WIFI GOT IP";
 const unsigned long LOOP_TIMEOUT = 2000;
 bool WifiInterface::connected = false;
 Stream * WifiInterface::wifiStream;
+HardwareSerial * WifiInterface::wifiSerial;
+long WifiInterface::linkSpeed;
+byte WifiInterface::fastSpeed;
 
 #ifndef WIFI_CONNECT_TIMEOUT
 // Tested how long it takes to FAIL an unknown SSID on firmware 1.7.4.
 #define WIFI_CONNECT_TIMEOUT 14000
 #endif
 
+#ifndef WIFI_IDLE_TIMEOUT
+// Seconds the ESP keeps a silent client connected, 180 is the ESP default.
+#define WIFI_IDLE_TIMEOUT 180
+#endif
+
+#ifndef WIFI_SERIAL_FAST_SPEEDS
+// Tried in turn once the ESP answers at WIFI_SERIAL_LINK_SPEED, e.g. 500000, 250000 which 
+// divide both a 16MHz AVR clock and the ESP's 80MHz one. Off by default: the AT+GMR check
+// passes at 500000 but a 64 byte serial buffer overruns when a loop() is slow under load.
+#define WIFI_SERIAL_FAST_SPEEDS 0
+#endif
+const long FAST_SPEEDS[] = { WIFI_SERIAL_FAST_SPEEDS };
+const byte FAST_SPEED_COUNT = sizeof(FAST_SPEEDS) / sizeof(FAST_SPEEDS[0]);
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Figure out number of serial ports depending on hardware
@@ -55,14 +73,56 @@ Stream * WifiInterface::wifiStream;
 #define NUM_SERIAL 1
 #endif
 
+wifiSetupState WifiInterface::setupState = WIFI_SETUP_DONE;
+byte WifiInterface::serialPort = 0;
+long WifiInterface::setupSpeed;
+const __FlashStringHelper * WifiInterface::setupSSid;
+const __FlashStringHelper * WifiInterface::setupPassword;
+const __FlashStringHelper * WifiInterface::setupHostname;
+int WifiInterface::setupPort;
+bool WifiInterface::oldCmd = false;
+bool WifiInterface::ipOK;
+byte WifiInterface::retries;
+byte WifiInterface::readIndex;
+char WifiInterface::macAddress[17];
+const char * WifiInterface::checkFor;
+const char * WifiInterface::checkLocator;
+unsigned long WifiInterface::checkStart;
+unsigned int WifiInterface::checkTimeout;
+bool WifiInterface::checkEcho;
+bool WifiInterface::checkEscapeEcho;
+
+// Serial1...Serial3 as the hardware has them, NULL when there are no more to try
+static HardwareSerial * serialStream(byte port, long speed) {
+  (void) speed;
+#if NUM_SERIAL > 0
+  if (port == 1) {
+    Serial1.begin(speed);
+    return &Serial1;
+  }
+#endif
+#if NUM_SERIAL > 1
+  if (port == 2) {
+    Serial2.begin(speed);
+    return &Serial2;
+  }
+#endif
+#if NUM_SERIAL > 2
+  if (port == 3) {
+    Serial3.begin(speed);
+    return &Serial3;
+  }
+#endif
+  return NULL;
+}
+
+// Returns at once, the ESP is brought up by loop(). 
+// False if there is no serial port the ESP could be on.
 bool WifiInterface::setup(long serial_link_speed, 
                           const __FlashStringHelper *wifiESSID,
                           const __FlashStringHelper *wifiPassword,
                           const __FlashStringHelper *hostname,
                           const int port) {
-
-  wifiSerialState wifiUp = WIFI_NOAT;
-
 #if NUM_SERIAL == 0
   // no warning about unused parameters. 
   (void) serial_link_speed;
@@ -70,221 +130,359 @@ bool WifiInterface::setup(long serial_link_speed,
   (void) wifiPassword;
   (void) hostname;
   (void) port;
+  return false;
+#else  
+  setupSpeed = serial_link_speed;
+  setupSSid = wifiESSID;
+  setupPassword = wifiPassword;
+  setupHostname = hostname;
+  setupPort = port;
+  memset(macAddress, '0', sizeof(macAddress));
+  serialPort = 0;
+  setupState = WIFI_SETUP_PORT;
+  return true;
 #endif  
-  
-#if NUM_SERIAL > 0
-  Serial1.begin(serial_link_speed);
-  wifiUp = setup(Serial1, wifiESSID, wifiPassword, hostname, port);
-#endif
-
-// Other serials are tried, depending on hardware.
-#if NUM_SERIAL > 1
-  if (wifiUp == WIFI_NOAT)
-  {
-    Serial2.begin(serial_link_speed);
-    wifiUp = setup(Serial2, wifiESSID, wifiPassword, hostname, port);
-  }
-#endif
-  
-#if NUM_SERIAL > 2
-  if (wifiUp == WIFI_NOAT)
-  {
-    Serial3.begin(serial_link_speed);
-    wifiUp = setup(Serial3, wifiESSID, wifiPassword, hostname, port);
-  }
-#endif
-
-  if (wifiUp == WIFI_NOAT) // here and still not AT commands found
-      return false;
+}
 
+void WifiInterface::setupDone(wifiSerialState wifiState) {
+  DIAG(F("\n++ Wifi Setup %S ++\n"), wifiState == WIFI_CONNECTED ? F("CONNECTED") : F("DISCONNECTED"));
   DCCEXParser::setAtCommandCallback(ATCommand);
   // CAUTION... ONLY CALL THIS ONCE 
-  WifiInboundHandler::setup(wifiStream);
-  if (wifiUp == WIFI_CONNECTED)
-      connected = true;
-  else
-      connected = false;
-  return connected; 
+  WifiInboundHandler::setup(wifiStream, linkSpeed);
+  connected = wifiState == WIFI_CONNECTED;
+  setupState = WIFI_SETUP_DONE;
+  DIAG(F("\nWifi setup finished %lms after boot\n"), millis());
 }
 
-wifiSerialState WifiInterface::setup(Stream & setupStream,  const __FlashStringHelper* SSid, const __FlashStringHelper* password,
-				     const __FlashStringHelper* hostname,  int port) {
-  wifiSerialState wifiState;
-  static uint8_t ntry = 0;
-  ntry++;
+// Wait for the reply to the command just sent, then carry on in state next 
+void WifiInterface::expect(wifiSetupState next, const unsigned int timeout, const char * waitfor, bool escapeEcho) {
+  setupState = next;
+  startCheck(timeout, waitfor, true, escapeEcho);
+}
 
-  wifiStream = &setupStream;
+// Ask the ESP for the next faster link speed to try, or go on with setup 
+// at the speed there is. AT+UART_CUR is not saved, an ESP reset goes back to the default. 
+void WifiInterface::nextLinkSpeed() {
+  if (fastSpeed < FAST_SPEED_COUNT && FAST_SPEEDS[fastSpeed] > linkSpeed) {
+    StringFormatter::send(wifiStream, F("AT+UART_CUR=%l,8,1,0,0\r\n"), FAST_SPEEDS[fastSpeed]);
+    expect(WIFI_SETUP_UART, 500, OK_SEARCH);
+    return;
+  }
+  StringFormatter::send(wifiStream, F("ATE1\r\n")); // Turn on the echo, se we can see what's happening
+  expect(WIFI_SETUP_ATE1, 2000, OK_SEARCH);        // Makes this visible on the console
+}
 
-  DIAG(F("\n++ Wifi Setup Try %d ++\n"), ntry);
+void WifiInterface::setLinkSpeed(long speed) {
+  wifiSerial->end();   // after the last command has gone at the old speed 
+  wifiSerial->begin(speed);
+  linkSpeed = speed;
+}
 
-  wifiState = setup2( SSid, password, hostname,  port);
+void WifiInterface::startAPMode() {
+  // If we have not managed to get this going in station mode, go for AP mode
+  StringFormatter::send(wifiStream, F("AT+CWMODE=2\r\n")); // configure as AccessPoint.
+  expect(WIFI_SETUP_CWMODE2, 1000, OK_SEARCH);  // Not always OK, sometimes "no change"
+}
 
-  if (wifiState == WIFI_NOAT) {
-      DIAG(F("\n++ Wifi Setup NO AT ++\n"));
-      return wifiState;
+void WifiInterface::startSoftAP() {
+  char macTail[]={macAddress[9],macAddress[10],macAddress[12],macAddress[13],macAddress[15],macAddress[16],'\0'};
+  while (wifiStream->available()) StringFormatter::printEscape( wifiStream->read()); /// THIS IS A DIAG IN DISGUISE
+  if (oldCmd) {
+    if (strncmp_P("Your network ", (const char*)setupPassword, 13) == 0) {
+      // unconfigured
+      StringFormatter::send(wifiStream, F("AT+CWSAP=\"DCCEX_%s\",\"PASS_%s\",1,4\r\n"), macTail, macTail);
+    } else {
+      // password configured by user
+      StringFormatter::send(wifiStream, F("AT+CWSAP=\"DCCEX_%s\",\"%s\",1,4\r\n"), macTail, setupPassword);
+    }
+    expect(WIFI_SETUP_CWSAP, WIFI_CONNECT_TIMEOUT, OK_SEARCH);
   }
- 
-  if (wifiState == WIFI_CONNECTED) {
-    StringFormatter::send(wifiStream, F("ATE0\r\n")); // turn off the echo 
-    checkForOK(200, OK_SEARCH, true);      
+  else {
+    StringFormatter::send(wifiStream, F("AT+CWSAP_CUR=\"DCCEX_%s\",\"PASS_%s\",1,4\r\n"), macTail, macTail);
+    expect(WIFI_SETUP_CWSAP_CUR, 20000, OK_SEARCH); 
   }
+}
 
-    
-  DIAG(F("\n++ Wifi Setup %S ++\n"), wifiState == WIFI_CONNECTED ? F("CONNECTED") : F("DISCONNECTED"));
-  return wifiState;
+void WifiInterface::startServer() {
+  StringFormatter::send(wifiStream, F("AT+CIPSERVER=0\r\n")); // turn off tcp server (to clean connections before CIPMUX=1)
+  expect(WIFI_SETUP_SERVER_OFF, 1000, OK_SEARCH); // ignore result in case it already was off
 }
 
-#ifdef DONT_TOUCH_WIFI_CONF
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-variable"
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-#endif
-wifiSerialState WifiInterface::setup2(const __FlashStringHelper* SSid, const __FlashStringHelper* password,
-				      const __FlashStringHelper* hostname, int port) {
-  bool ipOK = false;
-  bool oldCmd = false;
-
-  char macAddress[17];  //  mac address extraction   
-     
-  // First check... Restarting the Arduino does not restart the ES. 
-  //  There may alrerady be a connection with data in the pipeline.
-  // If there is, just shortcut the setup and continue to read the data as normal.
-  if (checkForOK(200,IPD_SEARCH, true)) {
-    DIAG(F("\nPreconfigured Wifi already running with data waiting\n"));
-   // loopstate=4;  // carry on from correct place... or not as the case may be  
-    return WIFI_CONNECTED; 
+// One step of the ESP bring-up each time it is called, the commands and timeouts
+// are those a blocking setup would use.
+void WifiInterface::setupLoop() {
+  if (setupState == WIFI_SETUP_PORT) {
+    serialPort++;
+    wifiSerial = serialStream(serialPort, setupSpeed);
+    wifiStream = wifiSerial;
+    linkSpeed = setupSpeed;
+    if (!wifiStream) {  // and still no AT commands found 
+      setupState = WIFI_SETUP_DONE;
+      return;
+    }
+    DIAG(F("\n++ Wifi Setup Try %d ++\n"), serialPort);
+    // First check... Restarting the Arduino does not restart the ES. 
+    //  There may alrerady be a connection with data in the pipeline.
+    // If there is, just shortcut the setup and continue to read the data as normal.
+    expect(WIFI_SETUP_IPD, 200, IPD_SEARCH);
+    return;
   }
 
-  StringFormatter::send(wifiStream, F("AT\r\n"));   // Is something here that understands AT?
-  if(!checkForOK(200, OK_SEARCH, true))
-    return WIFI_NOAT;                               // No AT compatible WiFi module here
-
-  StringFormatter::send(wifiStream, F("ATE1\r\n")); // Turn on the echo, se we can see what's happening
-  checkForOK(2000, OK_SEARCH, true);                // Makes this visible on the console
+  if (setupState == WIFI_SETUP_STA_IP) {
+    // The address follows as ,"a.b.c.d" and is 0.0.0.0 until the router has given one
+    while (readIndex < 3 && wifiStream->available()) {
+      int ch = wifiStream->read();
+      StringFormatter::printEscape(ch);
+      if (readIndex == 2) ipOK = ch != '0';
+      readIndex++;
+    }
+    // let the rest of the reply go by before the next command
+    if (readIndex == 3 || millis() - checkStart >= 1000) expect(WIFI_SETUP_STA_END, 1000, OK_SEARCH, false);
+    return;
+  }
 
-  // Display the AT version information
-  StringFormatter::send(wifiStream, F("AT+GMR\r\n")); 
-  checkForOK(2000, OK_SEARCH, true, false);      // Makes this visible on the console
+  if (setupState == WIFI_SETUP_AP_MAC) {
+    // Copy 17 byte mac address
+    while (readIndex < sizeof(macAddress) && wifiStream->available()) {
+      macAddress[readIndex] = wifiStream->read();
+      StringFormatter::printEscape(macAddress[readIndex]);
+      readIndex++;
+    }
+    if (readIndex == sizeof(macAddress) || millis() - checkStart >= 1000) {
+      retries = 0;
+      startSoftAP();
+    }
+    return;
+  }
 
+  wifiCheckResult check = pollCheck();
+  if (check == WIFI_CHECK_BUSY) return;
+  bool found = check == WIFI_CHECK_FOUND;
+
+  switch (setupState) {
+    case WIFI_SETUP_IPD:
+      if (found) {
+        DIAG(F("\nPreconfigured Wifi already running with data waiting\n"));
+        StringFormatter::send(wifiStream, F("ATE0\r\n")); // turn off the echo 
+        expect(WIFI_SETUP_ATE0, 200, OK_SEARCH);
+        break;
+      }
+      StringFormatter::send(wifiStream, F("AT\r\n"));   // Is something here that understands AT?
+      expect(WIFI_SETUP_AT, 200, OK_SEARCH);
+      break;
+
+    case WIFI_SETUP_AT:
+      if (!found) {  // No AT compatible WiFi module here
+        DIAG(F("\n++ Wifi Setup NO AT ++\n"));
+        setupState = WIFI_SETUP_PORT;
+        break;
+      }
+      fastSpeed = 0;
+      nextLinkSpeed();
+      break;
+
+    case WIFI_SETUP_UART:
+      if (!found) {  // firmware without AT+UART_CUR 
+        fastSpeed = FAST_SPEED_COUNT;
+        nextLinkSpeed();
+        break;
+      }
+      // The ESP has changed speed after its OK, a burst of version information
+      // shows whether the Arduino can keep up.
+      setLinkSpeed(FAST_SPEEDS[fastSpeed]);
+      StringFormatter::send(wifiStream, F("AT+GMR\r\n")); 
+      expect(WIFI_SETUP_UART_CHECK, 500, OK_SEARCH, false);
+      break;
+
+    case WIFI_SETUP_UART_CHECK:
+      if (found) {
+        DIAG(F("\nWifi link at %l baud\n"), linkSpeed);
+        fastSpeed = FAST_SPEED_COUNT;
+        nextLinkSpeed();
+        break;
+      }
+      DIAG(F("\nWifi link failed at %l baud\n"), linkSpeed);
+      // the ESP probably still understands, even if its replies are lost 
+      StringFormatter::send(wifiStream, F("AT+UART_CUR=%l,8,1,0,0\r\n"), setupSpeed);
+      setLinkSpeed(setupSpeed);
+      expect(WIFI_SETUP_UART_SETTLE, 100, OK_SEARCH);  // its OK is sent at the old speed 
+      break;
+
+    case WIFI_SETUP_UART_SETTLE:
+      StringFormatter::send(wifiStream, F("AT\r\n")); 
+      expect(WIFI_SETUP_UART_REVERT, 200, OK_SEARCH);
+      break;
+
+    case WIFI_SETUP_UART_REVERT:
+      if (!found) DIAG(F("\nWifi link lost, reset the ESP\n"));
+      fastSpeed++;
+      nextLinkSpeed();
+      break;
+
+    case WIFI_SETUP_ATE1:
+      // Display the AT version information
+      StringFormatter::send(wifiStream, F("AT+GMR\r\n")); 
+      expect(WIFI_SETUP_GMR, 2000, OK_SEARCH, false);      // Makes this visible on the console
+      break;
+
+    case WIFI_SETUP_GMR:
 #ifdef DONT_TOUCH_WIFI_CONF
-  DIAG(F("\nDONT_TOUCH_WIFI_CONF was set: Using existing config\n"));
+      DIAG(F("\nDONT_TOUCH_WIFI_CONF was set: Using existing config\n"));
+      StringFormatter::send(wifiStream, F("AT+CIFSR\r\n")); // Display  ip addresses to the DIAG 
+      expect(WIFI_SETUP_CIFSR, 1000, OK_SEARCH, false);
 #else
-  StringFormatter::send(wifiStream, F("AT+CWMODE=1\r\n")); // configure as "station" = WiFi client
-  checkForOK(1000, OK_SEARCH, true);                       // Not always OK, sometimes "no change"
-
-  // If the source code looks unconfigured, check if the
-  // ESP8266 is preconfigured. We check the first 13 chars
-  // of the SSid.
-  const char *yourNetwork = "Your network ";
-  if (strncmp_P(yourNetwork, (const char*)SSid, 13) == 0 || ((const char *)SSid)[0] == '\0') {
-    delay(8000); // give a preconfigured ES8266 a chance to connect to a router  
-                 // typical connect time approx 7 seconds
-    StringFormatter::send(wifiStream, F("AT+CIFSR\r\n"));
-    if (checkForOK(5000, (const char*) F("+CIFSR:STAIP"), true,false))
-	if (!checkForOK(1000, (const char*) F("0.0.0.0"), true,false))
-	    ipOK = true;
-  } else { // Should this really be "else" here /haba
-
-    if (!ipOK) {
-
+      StringFormatter::send(wifiStream, F("AT+CWMODE=1\r\n")); // configure as "station" = WiFi client
+      expect(WIFI_SETUP_CWMODE1, 1000, OK_SEARCH);              // Not always OK, sometimes "no change"
+#endif
+      break;
+
+    case WIFI_SETUP_CWMODE1:
+      // If the source code looks unconfigured, check if the
+      // ESP8266 is preconfigured. We check the first 13 chars
+      // of the SSid.
+      if (strncmp_P("Your network ", (const char*)setupSSid, 13) == 0 || ((const char *)setupSSid)[0] == '\0') {
+        // typical connect time approx 7 seconds, done as soon as the ESP says it has an address 
+        expect(WIFI_SETUP_PRECONFIGURED, 8000, GOT_IP_SEARCH);
+        break;
+      }
       // Older ES versions have AT+CWJAP, newer ones have AT+CWJAP_CUR and AT+CWHOSTNAME
       StringFormatter::send(wifiStream, F("AT+CWJAP?\r\n"));
-      if (checkForOK(2000, OK_SEARCH, true)) {
-        oldCmd=true;
-	while (wifiStream->available()) StringFormatter::printEscape( wifiStream->read()); /// THIS IS A DIAG IN DISGUISE
-
-	// AT command early version supports CWJAP/CWSAP
-	if (SSid) {
-	  StringFormatter::send(wifiStream, F("AT+CWJAP=\"%S\",\"%S\"\r\n"), SSid, password);
-	  ipOK = checkForOK(WIFI_CONNECT_TIMEOUT, OK_SEARCH, true);
-	}
-	DIAG(F("\n**\n"));
-
-      } else {
+      expect(WIFI_SETUP_CWJAP_QUERY, 2000, OK_SEARCH);
+      break;
+
+    case WIFI_SETUP_PRECONFIGURED:
+      StringFormatter::send(wifiStream, F("AT+CIFSR\r\n"));
+      expect(WIFI_SETUP_STA_CIFSR, 5000, (const char*) F("+CIFSR:STAIP"), false);
+      break;
+
+    case WIFI_SETUP_CWJAP_QUERY:
+      if (found) {
+        // AT command early version supports CWJAP/CWSAP
+        oldCmd = true;
+        while (wifiStream->available()) StringFormatter::printEscape( wifiStream->read()); /// THIS IS A DIAG IN DISGUISE
+        StringFormatter::send(wifiStream, F("AT+CWJAP=\"%S\",\"%S\"\r\n"), setupSSid, setupPassword);
+        expect(WIFI_SETUP_CWJAP, WIFI_CONNECT_TIMEOUT, OK_SEARCH);
+        break;
+      }
       // later version supports CWJAP_CUR
-
-        StringFormatter::send(wifiStream, F("AT+CWHOSTNAME=\"%S\"\r\n"), hostname); // Set Host name for Wifi Client
-	checkForOK(2000, OK_SEARCH, true); // dont care if not supported
-      
-	if (SSid) {
-	  StringFormatter::send(wifiStream, F("AT+CWJAP_CUR=\"%S\",\"%S\"\r\n"), SSid, password);
-	  ipOK = checkForOK(WIFI_CONNECT_TIMEOUT, OK_SEARCH, true);
-	}
+      StringFormatter::send(wifiStream, F("AT+CWHOSTNAME=\"%S\"\r\n"), setupHostname); // Set Host name for Wifi Client
+      expect(WIFI_SETUP_HOSTNAME, 2000, OK_SEARCH); // dont care if not supported
+      break;
+
+    case WIFI_SETUP_HOSTNAME:
+      StringFormatter::send(wifiStream, F("AT+CWJAP_CUR=\"%S\",\"%S\"\r\n"), setupSSid, setupPassword);
+      expect(WIFI_SETUP_CWJAP, WIFI_CONNECT_TIMEOUT, OK_SEARCH);
+      break;
+
+    case WIFI_SETUP_CWJAP:
+      if (!found) {
+        startAPMode();
+        break;
       }
-
-      if (ipOK) {
-	// But we really only have the ESSID and password correct
-        // Let's check for IP
-        ipOK = false;
-	StringFormatter::send(wifiStream, F("AT+CIFSR\r\n"));
-	if (checkForOK(5000, (const char*) F("+CIFSR:STAIP"), true,false))
-	  if (!checkForOK(1000, (const char*) F("0.0.0.0"), true,false))
-	    ipOK = true;
+      // But we really only have the ESSID and password correct
+      // Let's check for IP
+      StringFormatter::send(wifiStream, F("AT+CIFSR\r\n"));
+      expect(WIFI_SETUP_STA_CIFSR, 5000, (const char*) F("+CIFSR:STAIP"), false);
+      break;
+
+    case WIFI_SETUP_STA_CIFSR:
+      if (!found) {
+        startAPMode();
+        break;
       }
-    }
-  }
-
-  if (!ipOK) {
-    // If we have not managed to get this going in station mode, go for AP mode
-
-    StringFormatter::send(wifiStream, F("AT+CWMODE=2\r\n")); // configure as AccessPoint.
-    checkForOK(1000, OK_SEARCH, true); // Not always OK, sometimes "no change"
-
-    // Figure out MAC addr
-    StringFormatter::send(wifiStream, F("AT+CIFSR\r\n"));
-    // looking fpr mac addr eg +CIFSR:APMAC,"be:dd:c2:5c:6b:b7"
-    if (checkForOK(5000, (const char*) F("+CIFSR:APMAC,\""), true,false)) {
-      // Copy 17 byte mac address
-      for (int i=0; i<17;i++) {
-        while(!wifiStream->available());
-	macAddress[i]=wifiStream->read();
-	StringFormatter::printEscape(macAddress[i]);
+      readIndex = 0;
+      ipOK = true;
+      checkStart = millis();
+      setupState = WIFI_SETUP_STA_IP;
+      break;
+
+    case WIFI_SETUP_STA_END:
+      if (ipOK) startServer();
+      else startAPMode();
+      break;
+
+    case WIFI_SETUP_CWMODE2:
+      // Figure out MAC addr
+      StringFormatter::send(wifiStream, F("AT+CIFSR\r\n"));
+      // looking fpr mac addr eg +CIFSR:APMAC,"be:dd:c2:5c:6b:b7"
+      expect(WIFI_SETUP_AP_CIFSR, 5000, (const char*) F("+CIFSR:APMAC,\""), false);
+      break;
+
+    case WIFI_SETUP_AP_CIFSR:
+      if (found) {
+        readIndex = 0;
+        checkStart = millis();
+        setupState = WIFI_SETUP_AP_MAC;
+        break;
       }
-    }
-    char macTail[]={macAddress[9],macAddress[10],macAddress[12],macAddress[13],macAddress[15],macAddress[16],'\0'};
-
-    if (oldCmd) {
-      while (wifiStream->available()) StringFormatter::printEscape( wifiStream->read()); /// THIS IS A DIAG IN DISGUISE
-
-      int i=0;
-      do {
-        if (strncmp_P(yourNetwork, (const char*)password, 13) == 0) {
-	  // unconfigured
-	  StringFormatter::send(wifiStream, F("AT+CWSAP=\"DCCEX_%s\",\"PASS_%s\",1,4\r\n"), macTail, macTail);
-	} else {
-	  // password configured by user
-          StringFormatter::send(wifiStream, F("AT+CWSAP=\"DCCEX_%s\",\"%s\",1,4\r\n"), macTail, password);
-	}
-      } while (i++<2 && !checkForOK(WIFI_CONNECT_TIMEOUT, OK_SEARCH, true)); // do twice if necessary but ignore failure as AP mode may still be ok
-    } else {
+      retries = 0;
+      startSoftAP();
+      break;
+
+    case WIFI_SETUP_CWSAP:
+      // do twice more if necessary but ignore failure as AP mode may still be ok
+      if (!found && retries++ < 2) startSoftAP();
+      else startServer();
+      break;
+
+    case WIFI_SETUP_CWSAP_CUR:
+      // can ignore failure as SSid mode may still be ok
+      StringFormatter::send(wifiStream, F("AT+CIPRECVMODE=0\r\n")); // make sure transfer mode is correct
+      expect(WIFI_SETUP_RECVMODE, 2000, OK_SEARCH);
+      break;
+
+    case WIFI_SETUP_RECVMODE:
+      startServer();
+      break;
+
+    case WIFI_SETUP_SERVER_OFF:
+      StringFormatter::send(wifiStream, F("AT+CIPMUX=1\r\n")); // configure for multiple connections
+      expect(WIFI_SETUP_CIPMUX, 1000, OK_SEARCH);
+      break;
+
+    case WIFI_SETUP_CIPMUX:
+      if (!found) {
+        setupDone(WIFI_DISCONNECTED);
+        break;
+      }
+      StringFormatter::send(wifiStream, F("AT+CIPSERVER=1,%d\r\n"), setupPort); // turn on server on port
+      expect(WIFI_SETUP_SERVER_ON, 1000, OK_SEARCH);
+      break;
+
+    case WIFI_SETUP_SERVER_ON:
+      if (!found) {
+        setupDone(WIFI_DISCONNECTED);
+        break;
+      }
+      // the ESP closes clients that go quiet, so dead phones don't keep its 5 links
+      StringFormatter::send(wifiStream, F("AT+CIPSTO=%d\r\n"), WIFI_IDLE_TIMEOUT);
+      expect(WIFI_SETUP_CIPSTO, 1000, OK_SEARCH);
+      break;
+
+    case WIFI_SETUP_CIPSTO:
+      if (!found) DIAG(F("\nWifi idle timeout not set\n"));
+      StringFormatter::send(wifiStream, F("AT+CIFSR\r\n")); // Display  ip addresses to the DIAG 
+      expect(WIFI_SETUP_CIFSR, 1000, OK_SEARCH, false);
+      break;
+
+    case WIFI_SETUP_CIFSR:
+      if (!found) {
+        setupDone(WIFI_DISCONNECTED);
+        break;
+      }
+      DIAG(F("\nPORT=%d\n"), setupPort);
+      StringFormatter::send(wifiStream, F("ATE0\r\n")); // turn off the echo 
+      expect(WIFI_SETUP_ATE0, 200, OK_SEARCH);
+      break;
 
-      StringFormatter::send(wifiStream, F("AT+CWSAP_CUR=\"DCCEX_%s\",\"PASS_%s\",1,4\r\n"), macTail, macTail);
-      checkForOK(20000, OK_SEARCH, true); // can ignore failure as SSid mode may still be ok
-      
-      StringFormatter::send(wifiStream, F("AT+CIPRECVMODE=0\r\n"), port); // make sure transfer mode is correct
-      checkForOK(2000, OK_SEARCH, true);
-    }
-  }
+    case WIFI_SETUP_ATE0:
+      setupDone(WIFI_CONNECTED);
+      break;
 
-  StringFormatter::send(wifiStream, F("AT+CIPSERVER=0\r\n")); // turn off tcp server (to clean connections before CIPMUX=1)
-  checkForOK(1000, OK_SEARCH, true); // ignore result in case it already was off
-   
-  StringFormatter::send(wifiStream, F("AT+CIPMUX=1\r\n")); // configure for multiple connections
-  if (!checkForOK(1000, OK_SEARCH, true)) return WIFI_DISCONNECTED;
-
-  StringFormatter::send(wifiStream, F("AT+CIPSERVER=1,%d\r\n"), port); // turn on server on port
-  if (!checkForOK(1000, OK_SEARCH, true)) return WIFI_DISCONNECTED;
-#endif //DONT_TOUCH_WIFI_CONF
- 
-  StringFormatter::send(wifiStream, F("AT+CIFSR\r\n")); // Display  ip addresses to the DIAG 
-  if (!checkForOK(1000, OK_SEARCH, true, false)) return WIFI_DISCONNECTED;
-  DIAG(F("\nPORT=%d\n"),port);
-   
-  return WIFI_CONNECTED;
+    default:
+      break;
+  }
 }
-#ifdef DONT_TOUCH_WIFI_CONF
-#pragma GCC diagnostic pop
-#endif
 
 
 // This function is used to allow users to enter <+ commands> through the DCCEXParser
@@ -306,34 +504,46 @@ void WifiInterface::ATCommand(const byte * command) {
 
 
 
-bool WifiInterface::checkForOK( const unsigned int timeout, const char * waitfor, bool echo, bool escapeEcho) {
-  unsigned long  startTime = millis();
-  char  const *locator = waitfor;
+void WifiInterface::startCheck( const unsigned int timeout, const char * waitfor, bool echo, bool escapeEcho) {
+  checkStart = millis();
+  checkTimeout = timeout;
+  checkFor = waitfor;
+  checkLocator = waitfor;
+  checkEcho = echo;
+  checkEscapeEcho = escapeEcho;
   DIAG(F("\nWifi Check: [%E]"), waitfor);
-  while ( millis() - startTime < timeout) {
-    while (wifiStream->available()) {
-      int ch = wifiStream->read();
-      if (echo) {
-        if (escapeEcho) StringFormatter::printEscape( ch); /// THIS IS A DIAG IN DISGUISE
-        else DIAG(F("%c"), ch); 
-      }
-      if (ch != pgm_read_byte_near(locator)) locator = waitfor;
-      if (ch == pgm_read_byte_near(locator)) {
-        locator++;
-        if (!pgm_read_byte_near(locator)) {
-          DIAG(F("\nFound in %dms"), millis() - startTime);
-          return true;
-        }
+}
+
+wifiCheckResult WifiInterface::pollCheck() {
+  while (wifiStream->available()) {
+    int ch = wifiStream->read();
+    if (checkEcho) {
+      if (checkEscapeEcho) StringFormatter::printEscape( ch); /// THIS IS A DIAG IN DISGUISE
+      else DIAG(F("%c"), ch); 
+    }
+    if (ch != pgm_read_byte_near(checkLocator)) checkLocator = checkFor;
+    if (ch == pgm_read_byte_near(checkLocator)) {
+      checkLocator++;
+      if (!pgm_read_byte_near(checkLocator)) {
+        DIAG(F("\nFound in %lms"), millis() - checkStart);
+        return WIFI_CHECK_FOUND;
       }
     }
   }
-  DIAG(F("\nTIMEOUT after %dms\n"), timeout);
-  return false;
+  if (millis() - checkStart < checkTimeout) return WIFI_CHECK_BUSY;
+  DIAG(F("\nTIMEOUT after %dms\n"), checkTimeout);
+  return WIFI_CHECK_TIMEOUT;
+}
+
+bool WifiInterface::checkForOK( const unsigned int timeout, const char * waitfor, bool echo, bool escapeEcho) {
+  wifiCheckResult check;
+  startCheck(timeout, waitfor, echo, escapeEcho);
+  while ((check = pollCheck()) == WIFI_CHECK_BUSY) {}
+  return check == WIFI_CHECK_FOUND;
 }
 
 
 void WifiInterface::loop() {
-  if (connected) {
-    WifiInboundHandler::loop(); 
-  }
+  if (setupState != WIFI_SETUP_DONE) setupLoop();
+  else if (connected) WifiInboundHandler::loop(); 
 }
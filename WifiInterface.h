@@ -26,6 +26,43 @@
 
 enum wifiSerialState { WIFI_NOAT, WIFI_DISCONNECTED, WIFI_CONNECTED };
 
+// Setup only starts the ESP bring-up. Each AT command and its reply is then a 
+// state stepped from loop(), so DCC runs while the ESP takes its time to connect.
+enum wifiSetupState {
+  WIFI_SETUP_PORT,        // try the next serial port
+  WIFI_SETUP_IPD,         // is a preconfigured ESP already sending data?
+  WIFI_SETUP_AT,          // anything that understands AT?
+  WIFI_SETUP_UART,        // will it go faster?
+  WIFI_SETUP_UART_CHECK,  // does it work at the faster speed?
+  WIFI_SETUP_UART_SETTLE, // gone back to the slower speed
+  WIFI_SETUP_UART_REVERT,
+  WIFI_SETUP_ATE1,
+  WIFI_SETUP_GMR,
+  WIFI_SETUP_CWMODE1,
+  WIFI_SETUP_PRECONFIGURED, // give a preconfigured ESP a chance to connect to a router
+  WIFI_SETUP_CWJAP_QUERY,
+  WIFI_SETUP_HOSTNAME,
+  WIFI_SETUP_CWJAP,
+  WIFI_SETUP_STA_CIFSR,
+  WIFI_SETUP_STA_IP,       // is the station address 0.0.0.0?
+  WIFI_SETUP_STA_END,
+  WIFI_SETUP_CWMODE2,
+  WIFI_SETUP_AP_CIFSR,
+  WIFI_SETUP_AP_MAC,
+  WIFI_SETUP_CWSAP,
+  WIFI_SETUP_CWSAP_CUR,
+  WIFI_SETUP_RECVMODE,
+  WIFI_SETUP_SERVER_OFF,
+  WIFI_SETUP_CIPMUX,
+  WIFI_SETUP_SERVER_ON,
+  WIFI_SETUP_CIPSTO,
+  WIFI_SETUP_CIFSR,
+  WIFI_SETUP_ATE0,
+  WIFI_SETUP_DONE
+};
+
+enum wifiCheckResult { WIFI_CHECK_BUSY, WIFI_CHECK_FOUND, WIFI_CHECK_TIMEOUT };
+
 class WifiInterface
 {
 
@@ -39,12 +76,21 @@ public:
   static void ATCommand(const byte *command);
 
 private:
-  static wifiSerialState setup(Stream &setupStream, const __FlashStringHelper *SSSid, const __FlashStringHelper *password,
-                    const __FlashStringHelper *hostname, int port);
+  static void setupLoop();
+  static void setupDone(wifiSerialState wifiState);
+  static void expect(wifiSetupState next, const unsigned int timeout, const char *waitfor, bool escapeEcho = true);
+  static void nextLinkSpeed();
+  static void setLinkSpeed(long speed);
+  static void startAPMode();
+  static void startSoftAP();
+  static void startServer();
   static Stream *wifiStream;
+  static HardwareSerial *wifiSerial;
+  static long linkSpeed;
+  static byte fastSpeed;   // index of the faster speed being tried
   static DCCEXParser parser;
-  static wifiSerialState setup2(const __FlashStringHelper *SSSid, const __FlashStringHelper *password,
-                     const __FlashStringHelper *hostname, int port);
+  static void startCheck(const unsigned int timeout, const char *waitfor, bool echo, bool escapeEcho = true);
+  static wifiCheckResult pollCheck();
   static bool checkForOK(const unsigned int timeout, const char *waitfor, bool echo, bool escapeEcho = true);
   static bool connected;
   static bool closeAfter;
@@ -52,5 +98,27 @@ private:
   static int datalength;
   static int connectionId;
   static unsigned long loopTimeoutStart;
+
+  // setup state 
+  static wifiSetupState setupState;
+  static byte serialPort;   // 1 = Serial1...
+  static long setupSpeed;
+  static const __FlashStringHelper *setupSSid;
+  static const __FlashStringHelper *setupPassword;
+  static const __FlashStringHelper *setupHostname;
+  static int setupPort;
+  static bool oldCmd;
+  static bool ipOK;
+  static byte retries;
+  static byte readIndex;   // of the station IP or AP MAC address
+  static char macAddress[17];
+
+  // state of the reply being waited for 
+  static const char *checkFor;
+  static const char *checkLocator;
+  static unsigned long checkStart;
+  static unsigned int checkTimeout;
+  static bool checkEcho;
+  static bool checkEscapeEcho;
 };
 #endif
@@ -0,0 +1,397 @@
+/*
+ *  © 2020, Chris Harlow. All rights reserved.
+ *
+ *  This file is part of DCC-EX CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "defines.h"
+#if Z21_ON == true
+#include "Z21Server.h"
+#include "DCC.h"
+#include "DCCWaveform.h"
+#include "Turnouts.h"
+#include "StringFormatter.h"
+#include "DIAG.h"
+
+EthernetUDP * Z21Server::udp=NULL;
+byte Z21Server::buffer[MAX_DATAGRAM];
+Z21_CLIENT Z21Server::clients[MAX_CLIENTS];
+Z21_CLIENT * Z21Server::target=NULL;
+bool Z21Server::packetOpen=false;
+bool Z21Server::stopPending=false;
+unsigned long Z21Server::datagrams=0;
+unsigned long Z21Server::messages=0;
+unsigned long Z21Server::unknown=0;
+unsigned long Z21Server::datagramsSent=0;
+
+void Z21Server::setup() {
+  udp=new EthernetUDP();
+  udp->begin(PORT);
+  DIAG(F("\nZ21 port %d\n"), PORT);
+}
+
+bool Z21Server::loop() {
+  int size=udp->parsePacket();
+  if (size<=0) return false;
+  datagrams++;
+  if (size>MAX_DATAGRAM) return true;  // the next parsePacket() discards it
+  int count=udp->read(buffer, MAX_DATAGRAM);
+  Z21_CLIENT * client=lookupClient(udp->remoteIP(), udp->remotePort());
+  if (!client) return true;
+  client->lastMillis=millis();
+
+  openPacket(client);  // the replies to all of its messages go back in one datagram
+  byte * message=buffer;
+  while (count>=4) {
+    int length=message[0] | (message[1]<<8);
+    if (length<4 || length>count) break;
+    messages++;
+    handle(message[2] | (message[3]<<8), message+4, length-4);
+    message+=length;
+    count-=length;
+  }
+  closePacket();
+  return true;
+}
+
+// Find (or add) the client at this address, forgetting any that have gone quiet.
+// When the table is full the one silent longest makes way.
+Z21_CLIENT * Z21Server::lookupClient(uint32_t ip, uint16_t port) {
+  Z21_CLIENT * freeClient=NULL;
+  for (byte c=0;c<MAX_CLIENTS;c++) {
+    Z21_CLIENT * client=&clients[c];
+    if (client->port && millis()-client->lastMillis > CLIENT_TIMEOUT_MILLIS) client->port=0;
+    if (client->port==port && client->ip==ip) return client;
+    if (!freeClient || (freeClient->port && (client->port==0 ||
+        millis()-client->lastMillis > millis()-freeClient->lastMillis))) freeClient=client;
+  }
+  if (freeClient->port) DIAG(F("\nZ21 client table full, dropped port %d\n"), freeClient->port);
+  memset(freeClient,0,sizeof(Z21_CLIENT));
+  freeClient->ip=ip;
+  freeClient->port=port;
+  return freeClient;
+}
+
+void Z21Server::subscribeLoco(Z21_CLIENT * client, int cab) {
+  byte i;
+  for (i=0;i<MAX_Z21_LOCOS-1;i++) if (client->locos[i]==(uint16_t)cab) break;
+  memmove(client->locos+1, client->locos, i*sizeof(client->locos[0]));
+  client->locos[0]=cab;
+}
+
+bool Z21Server::wantsLoco(Z21_CLIENT * client, int cab) {
+  if (client->flags & FLAG_ALL_LOCOS) return true;
+  if (!(client->flags & FLAG_DRIVING)) return false;
+  for (byte i=0;i<MAX_Z21_LOCOS;i++) if (client->locos[i]==(uint16_t)cab) return true;
+  return false;
+}
+
+void Z21Server::handle(uint16_t header, byte * data, byte size) {
+  switch (header) {
+    case LAN_GET_SERIAL_NUMBER:
+      sendLong(LAN_GET_SERIAL_NUMBER, 1);
+      return;
+    case LAN_GET_CODE: {
+      byte code=0;  // nothing locked
+      send(LAN_GET_CODE, &code, 1);
+      return;
+    }
+    case LAN_GET_HWINFO: {
+      byte info[8]={0x01, 0x02, 0, 0, 0x40, 0x01, 0, 0};  // Z21 hardware, firmware 1.40
+      send(LAN_GET_HWINFO, info, sizeof(info));
+      return;
+    }
+    case LAN_LOGOFF:
+      target->port=0;
+      return;
+    case LAN_X:
+      handleX(data, size);
+      return;
+    case LAN_SET_BROADCASTFLAGS:
+      if (size<4) break;
+      target->flags=data[0] | ((uint32_t)data[1]<<8) | ((uint32_t)data[2]<<16) | ((uint32_t)data[3]<<24);
+      return;
+    case LAN_GET_BROADCASTFLAGS:
+      sendLong(LAN_GET_BROADCASTFLAGS, target->flags);
+      return;
+    case LAN_SYSTEMSTATE_GETDATA:
+      sendSystemState();
+      return;
+  }
+  unknown++;
+  if (Diag::ETHERNET) DIAG(F("\nZ21 unknown header %x\n"), header);
+}
+
+void Z21Server::handleX(byte * data, byte size) {
+  byte check=0;
+  for (byte i=0;i<size;i++) check^=data[i];
+  if (size<2 || check!=0) return;  // the Z21 ignores a bad checksum
+  byte reply[8];
+  switch (data[0]) {
+    case 0x21:
+      switch (data[1]) {
+        case 0x21: // LAN_X_GET_VERSION, X-Bus V3.0, command station id 0x12
+          reply[0]=0x63; reply[1]=0x21; reply[2]=0x30; reply[3]=0x12;
+          sendX(reply, 4);
+          return;
+        case 0x24: // LAN_X_GET_STATUS
+          reply[0]=0x62; reply[1]=0x22; reply[2]=centralState();
+          sendX(reply, 3);
+          return;
+        case 0x80: // LAN_X_SET_TRACK_POWER_OFF
+        case 0x81: // LAN_X_SET_TRACK_POWER_ON
+          setPower(data[1]==0x81);
+          // clients with the flag are told by the broadcast
+          if (!(target->flags & FLAG_DRIVING)) sendPower();
+          return;
+      }
+      break;
+
+    case 0x80: // LAN_X_SET_STOP
+      if (data[1]!=0x80) break;
+      stop();
+      return;
+
+    case 0xF1: // LAN_X_GET_FIRMWARE_VERSION, 1.40
+      if (data[1]!=0x0A) break;
+      reply[0]=0xF3; reply[1]=0x0A; reply[2]=0x01; reply[3]=0x40;
+      sendX(reply, 4);
+      return;
+
+    case 0xE3: // LAN_X_GET_LOCO_INFO
+      if (data[1]!=0xF0 || size<5) break;
+      {
+        int cab=((data[2] & 0x3F)<<8) | data[3];
+        subscribeLoco(target, cab);
+        sendLocoInfo(cab);
+      }
+      return;
+
+    case 0xE4:
+      if (size<6) break;
+      {
+        int cab=((data[2] & 0x3F)<<8) | data[3];
+        if (cab==0) break;
+        subscribeLoco(target, cab);
+        byte value=data[4];
+        if ((data[1] & 0xF0)==0x10) { // LAN_X_SET_LOCO_DRIVE
+          byte steps=data[1] & 0x0F;
+          byte speed=value & 0x7F;
+          if (steps==0 || steps==2) {
+            // DCC 14 and 28 step codes: 0 stop, 1 (28 steps 1-3) emergency stop, then the steps
+            byte step = steps==0 ? (speed & 0x0F) : (((speed & 0x0F)<<1) | ((speed>>4) & 1));
+            byte first = steps==0 ? 2 : 4;
+            byte count = steps==0 ? 14 : 28;
+            if (step==0 || (steps==2 && step==1)) speed=0;
+            else if (step<first) speed=1;
+            else speed=1 + ((step-first+1)*126 + count/2)/count;
+          }
+          DCC::setThrottle(cab, speed, (value & 0x80)!=0);
+          return;
+        }
+        if (data[1]==0xF8) { // LAN_X_SET_LOCO_FUNCTION
+          byte function=value & 0x3F;
+          byte type=value>>6;   // 0 off, 1 on, 2 toggle
+          if (type==2) DCC::setFn(cab, function, DCC::getFn(cab, function)!=1);
+          else if (type<2) DCC::setFn(cab, function, type==1);
+          return;
+        }
+      }
+      break;
+
+    case 0x43: // LAN_X_GET_TURNOUT_INFO
+      if (size<4) break;
+      {
+        int fadr=(data[1]<<8) | data[2];
+        sendTurnoutInfo(fadr, turnoutState(fadr));
+      }
+      return;
+
+    case 0x53: // LAN_X_SET_TURNOUT  DB2=10Q0A00P
+      if (size<5) break;
+      {
+        int fadr=(data[1]<<8) | data[2];
+        bool thrown=(data[3] & 0x01)!=0;
+        if (!(data[3] & 0x08)) return;  // deactivating the output, nothing to do
+        setTurnout(fadr, thrown);
+        // a defined turnout is broadcast, a plain accessory has no state to broadcast
+        if (!Turnout::get(fadr+1) || !(target->flags & FLAG_DRIVING))
+          sendTurnoutInfo(fadr, thrown ? 2 : 1);
+      }
+      return;
+  }
+  unknown++;
+  reply[0]=0x61; reply[1]=0x82;  // LAN_X_UNKNOWN_COMMAND
+  sendX(reply, 2);
+}
+
+void Z21Server::setTurnout(int fadr, bool thrown) {
+  if (Turnout::get(fadr+1)) Turnout::activate(fadr+1, thrown);
+  else DCC::setAccessory(fadr/4+1, fadr%4, thrown);
+}
+
+// as <1> and <0>
+void Z21Server::setPower(bool on) {
+  POWERMODE mode= on ? POWERMODE::ON : POWERMODE::OFF;
+  DCC::setProgTrackSyncMain(false);
+  DCCWaveform::mainTrack.setPowerMode(mode);
+  DCCWaveform::progTrack.setPowerMode(mode);
+  if (!on) DCC::setProgTrackBoost(false);
+}
+
+// Emergency stop every loco, the track stays powered
+void Z21Server::stop() {
+  DCC::setThrottle(0, 1, true);  // direction is kept for a broadcast stop
+  stopPending=true;              // LAN_X_BC_STOPPED goes with the loco broadcast
+  if (!(target->flags & FLAG_DRIVING)) sendStopped();
+}
+
+void Z21Server::sendStopped() {
+  byte x[3]={0x81, 0x00};
+  sendX(x, 2);
+}
+
+// Called by the CommandDistributor when anything of interest has changed.
+// Each client gets one datagram with everything it has asked for.
+void Z21Server::broadcast(const byte * pendingLocos, bool turnouts, bool power, bool current) {
+  for (byte c=0;c<MAX_CLIENTS;c++) {
+    Z21_CLIENT * client=&clients[c];
+    if (!client->port || !client->flags) continue;
+    openPacket(client);
+    if (power && (client->flags & FLAG_DRIVING)) sendPower();
+    if (stopPending && (client->flags & FLAG_DRIVING)) sendStopped();
+    if ((power || current) && (client->flags & FLAG_SYSTEM)) sendSystemState();
+    for (int reg=0;reg<MAX_LOCOS;reg++) {
+      if (!(pendingLocos[reg>>3] & (1<<(reg & 0x07)))) continue;
+      int cab;
+      byte speedCode;
+      unsigned long functions;
+      if (!DCC::getLocoState(reg, cab, speedCode, functions)) continue;
+      if (wantsLoco(client, cab)) sendLocoInfo(cab, speedCode, functions);
+    }
+    if (turnouts && (client->flags & FLAG_DRIVING))
+      for (Turnout * tt=Turnout::firstTurnout; tt!=NULL; tt=tt->nextTurnout)
+        if (tt->broadcastPending && tt->data.id>0)
+          sendTurnoutInfo(tt->data.id-1, (tt->data.tStatus & STATUS_ACTIVE) ? 2 : 1);
+    closePacket();
+  }
+  stopPending=false;
+}
+
+void Z21Server::openPacket(Z21_CLIENT * client) {
+  target=client;
+  packetOpen=false;  // started by the first send()
+}
+
+void Z21Server::closePacket() {
+  if (!packetOpen) return;
+  udp->endPacket();
+  packetOpen=false;
+  datagramsSent++;
+}
+
+void Z21Server::send(uint16_t header, const byte * data, byte size) {
+  if (!packetOpen) {
+    udp->beginPacket(IPAddress(target->ip), target->port);
+    packetOpen=true;
+  }
+  byte head[4]={(byte)(size+4), 0, lowByte(header), highByte(header)};
+  udp->write(head, 4);
+  udp->write(data, size);
+}
+
+void Z21Server::sendX(byte * x, byte size) {
+  byte check=0;
+  for (byte i=0;i<size;i++) check^=x[i];
+  x[size]=check;
+  send(LAN_X, x, size+1);
+}
+
+void Z21Server::sendLong(uint16_t header, uint32_t value) {
+  byte data[4]={(byte)value, (byte)(value>>8), (byte)(value>>16), (byte)(value>>24)};
+  send(header, data, 4);
+}
+
+// LAN_X_LOCO_INFO, always 128 steps
+void Z21Server::sendLocoInfo(int cab, byte speedCode, unsigned long functions) {
+  byte x[10];
+  x[0]=0xEF;
+  x[1]=highByte(cab) | (cab>=128 ? 0xC0 : 0);
+  x[2]=lowByte(cab);
+  x[3]=0x04;
+  x[4]=speedCode;
+  x[5]=((functions & 1)<<4) | ((functions>>1) & 0x0F);  // F0 F4 F3 F2 F1
+  x[6]=functions>>5;
+  x[7]=functions>>13;
+  x[8]=functions>>21;
+  sendX(x, 9);
+}
+
+void Z21Server::sendLocoInfo(int cab) {
+  int reg=DCC::lookupLoco(cab);   // asking about a loco must not take a slot for it
+  int regCab;
+  byte speedCode;
+  unsigned long functions;
+  if (DCC::getLocoState(reg, regCab, speedCode, functions)) sendLocoInfo(cab, speedCode, functions);
+  else sendLocoInfo(cab, 0x80, 0);  // not driven yet, stopped forward
+}
+
+// state 0 unknown, 1 straight (P=0), 2 thrown (P=1)
+void Z21Server::sendTurnoutInfo(int fadr, byte state) {
+  byte x[5]={0x43, highByte(fadr), lowByte(fadr), state};
+  sendX(x, 4);
+}
+
+byte Z21Server::turnoutState(int fadr) {
+  Turnout * tt=Turnout::get(fadr+1);
+  if (!tt) return 0;
+  return (tt->data.tStatus & STATUS_ACTIVE) ? 2 : 1;
+}
+
+void Z21Server::sendPower() {
+  byte x[3]={0x61, (byte)(DCCWaveform::mainTrack.getPowerMode()==POWERMODE::ON ? 0x01 : 0x00)};
+  sendX(x, 2);
+}
+
+byte Z21Server::centralState() {
+  byte state=0;
+  POWERMODE mode=DCCWaveform::mainTrack.getPowerMode();
+  if (mode==POWERMODE::OVERLOAD) state|=0x04;       // short circuit
+  else if (mode!=POWERMODE::ON) state|=0x02;        // track voltage off
+  return state;
+}
+
+// LAN_SYSTEMSTATE_DATACHANGED, temperature and voltages are not measured
+void Z21Server::sendSystemState() {
+  int mainmA=DCCWaveform::mainTrack.getCurrentmA();
+  int progmA=DCCWaveform::progTrack.getCurrentmA();
+  byte data[16]={lowByte(mainmA), highByte(mainmA), lowByte(progmA), highByte(progmA),
+                 lowByte(mainmA), highByte(mainmA), 0, 0, 0, 0, 0, 0, centralState(), 0, 0, 0};
+  send(LAN_SYSTEMSTATE_DATACHANGED, data, sizeof(data));
+}
+
+void Z21Server::displayStats(Print * stream) {
+  StringFormatter::send(stream, F("Z21 port %d datagrams=%l messages=%l unknown=%l sent=%l\n"),
+                        PORT, datagrams, messages, unknown, datagramsSent);
+  for (byte c=0;c<MAX_CLIENTS;c++) {
+    Z21_CLIENT * client=&clients[c];
+    if (!client->port) continue;
+    StringFormatter::send(stream, F("Z21 client port %d flags=%l locos %d %d %d %d idle %lms\n"),
+                          client->port, client->flags, client->locos[0], client->locos[1],
+                          client->locos[2], client->locos[3], millis()-client->lastMillis);
+  }
+}
+#endif
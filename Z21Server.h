@@ -0,0 +1,122 @@
+/*
+ *  © 2020, Chris Harlow. All rights reserved.
+ *
+ *  This file is part of DCC-EX CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef Z21Server_h
+#define Z21Server_h
+#include <Arduino.h>
+#include <Ethernet.h>
+
+/* Roco Z21 LAN protocol over UDP, for throttle apps that speak it natively.
+ *
+ * A datagram holds one or more messages: length(2) header(2) data..., low byte first.
+ * LAN_X messages carry an X-Bus command ending in an XOR checksum.
+ *
+ * Handled: serial number, hardware info, code, logoff, broadcast flags, system state,
+ *   X: version, status, track power on/off, stop, firmware version,
+ *      loco info, loco drive (14, 28 or 128 steps), loco function,
+ *      turnout info, set turnout.
+ * Loco speeds are always reported in 128 steps.
+ * Z21 accessory address FAdr (0 based) is turnout id FAdr+1 when that turnout
+ * is defined, otherwise DCC accessory address FAdr/4+1 subaddress FAdr%4.
+ *
+ * Every sender is a client. A client that has been silent for CLIENT_TIMEOUT_MILLIS
+ * is forgotten, as the Z21 does. Broadcasts go to clients by their flags:
+ *   DRIVING    power, turnouts and the locos it last asked about or drove
+ *   ALL_LOCOS  every loco
+ *   SYSTEM     system state when the power or current changes
+ */
+
+const byte MAX_Z21_LOCOS=4;
+struct Z21_CLIENT {
+  uint32_t ip;
+  uint16_t port;      // 0 if slot is free
+  uint32_t flags;     // broadcast flags
+  uint16_t locos[MAX_Z21_LOCOS];  // newest first, 0 if unused
+  unsigned long lastMillis;
+};
+
+class Z21Server {
+  public:
+    static void setup();
+    static bool loop();   // handles one datagram, false if there was none
+    static void broadcast(const byte * pendingLocos, bool turnouts, bool power, bool current);
+    static void displayStats(Print * stream);
+
+  private:
+    static const uint16_t PORT=21105;
+    static const int MAX_DATAGRAM=128;
+#ifdef ARDUINO_AVR_UNO
+    static const byte MAX_CLIENTS=2;
+#else
+    static const byte MAX_CLIENTS=8;
+#endif
+    static const unsigned long CLIENT_TIMEOUT_MILLIS=60000;
+
+    // message headers
+    static const uint16_t LAN_GET_SERIAL_NUMBER=0x10;
+    static const uint16_t LAN_GET_CODE=0x18;
+    static const uint16_t LAN_GET_HWINFO=0x1A;
+    static const uint16_t LAN_LOGOFF=0x30;
+    static const uint16_t LAN_X=0x40;
+    static const uint16_t LAN_SET_BROADCASTFLAGS=0x50;
+    static const uint16_t LAN_GET_BROADCASTFLAGS=0x51;
+    static const uint16_t LAN_SYSTEMSTATE_DATACHANGED=0x84;
+    static const uint16_t LAN_SYSTEMSTATE_GETDATA=0x85;
+
+    // broadcast flags
+    static const uint32_t FLAG_DRIVING=0x00000001;
+    static const uint32_t FLAG_SYSTEM=0x00000100;
+    static const uint32_t FLAG_ALL_LOCOS=0x00010000;
+
+    static EthernetUDP * udp;
+    static byte buffer[MAX_DATAGRAM];
+    static Z21_CLIENT clients[MAX_CLIENTS];
+    static Z21_CLIENT * target;   // where send() goes
+    static bool packetOpen;
+    static bool stopPending;
+
+    static Z21_CLIENT * lookupClient(uint32_t ip, uint16_t port);
+    static void subscribeLoco(Z21_CLIENT * client, int cab);
+    static bool wantsLoco(Z21_CLIENT * client, int cab);
+    static void handle(uint16_t header, byte * data, byte size);
+    static void handleX(byte * data, byte size);
+    static void setTurnout(int fadr, bool thrown);
+    static void setPower(bool on);
+    static void stop();
+
+    static void openPacket(Z21_CLIENT * client);
+    static void closePacket();
+    static void send(uint16_t header, const byte * data, byte size);
+    static void sendX(byte * x, byte size);  // x has room for the checksum after size bytes
+    static void sendLong(uint16_t header, uint32_t value);
+    static void sendLocoInfo(int cab, byte speedCode, unsigned long functions);
+    static void sendLocoInfo(int cab);
+    static void sendTurnoutInfo(int fadr, byte state);
+    static void sendPower();
+    static void sendStopped();
+    static void sendSystemState();
+    static byte turnoutState(int fadr);
+    static byte centralState();
+
+    // statistics
+    static unsigned long datagrams;
+    static unsigned long messages;
+    static unsigned long unknown;
+    static unsigned long datagramsSent;
+};
+#endif
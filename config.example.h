@@ -75,6 +75,26 @@ The configuration file for DCC++ EX Command Station
 // to set this if you have an extremely slow Wifi router.
 //
 //#define WIFI_CONNECT_TIMEOUT 14000
+//
+// Seconds a WiFi client may stay silent before the ESP closes it, so phones that
+// vanished don't keep the connections. Default is 180, 0 never closes.
+//
+//#define WIFI_IDLE_TIMEOUT 180
+
+// The link to the ESP stays at 115200 baud unless faster speeds are listed here, they are
+// tried in turn, going back to 115200 if none of them works. Only worth it on boards with 
+// a large serial buffer: at 500000 a Mega's 64 bytes overrun as soon as loop() is slow.
+// Default is 0.
+//
+//#define WIFI_SERIAL_FAST_SPEEDS 500000, 250000
+
+/////////////////////////////////////////////////////////////////////////////////////
+//
+// Time in microseconds the USB serial parser may spend executing buffered commands
+// in each loop() before WiFi, Ethernet etc get a turn. Default is 2000. Can also be
+// changed at run time with <D PARSER microseconds>.
+//
+//#define SERIAL_PARSE_MICROS 2000
 
 /////////////////////////////////////////////////////////////////////////////////////
 //
@@ -82,6 +102,30 @@ The configuration file for DCC++ EX Command Station
 // is not for Wifi. You will then need the Arduino Ethernet library as well
 //
 //#define ENABLE_ETHERNET true
+//
+// ETHERNET_IDLE_SECONDS: Close Ethernet clients that send nothing for this long.
+// Default 0 never closes them.
+//
+//#define ETHERNET_IDLE_SECONDS 600
+//
+// ETHERNET_EVICT_SECONDS: When every socket but the listening one holds a client
+// nobody new can connect, so close the client silent longest if it has been quiet 
+// this long. A W5100 has 4 sockets and UDP_PORT and Z21 take one each. 
+// Default 0 never closes them.
+//
+//#define ETHERNET_EVICT_SECONDS 60
+//
+// UDP_PORT: Also accept commands as UDP datagrams on this port (Ethernet only).
+// A datagram may start with a sequence number, e.g. "17<t 1 3 50 1>", then a
+// speed arriving after a newer one for the same cab is ignored. Replies come back
+// in one datagram starting with the same number.
+//
+//#define UDP_PORT 2561
+//
+// ENABLE_Z21: Set to true to also talk the Roco Z21 LAN protocol (UDP port 21105)
+// on Ethernet, for throttle apps that use it. 
+//
+//#define ENABLE_Z21 true
 
 
 /////////////////////////////////////////////////////////////////////////////////////
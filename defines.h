@@ -34,6 +34,13 @@
 #else
 #define ETHERNET_ON false
 #endif
+
+// Z21_ON: the Z21 protocol server runs on the Ethernet interface
+#if ETHERNET_ON && ENABLE_Z21
+#define Z21_ON true
+#else
+#define Z21_ON false
+#endif
  
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+#  © 2020, Chris Harlow. All rights reserved.
+#
+#  This file is part of DCC-EX CommandStation-EX
+#
+#  This is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  It is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+#
+# Decodes a serial capture taken with <D LOG ON>.
+# The DIAG format strings are read back out of the flash image of the same build.
+#
+#   diaglog.py [capture-file] [elf-file]
+#
+# With no capture file the capture is read from stdin, with no elf file the
+# latest Arduino IDE build in /tmp is used (as objdump.sh does).
+# Text that is not a log record (eg <...> replies) is passed through unchanged.
+
+import glob
+import os
+import struct
+import sys
+
+LOG_FRAME_START = 0x1E
+LOG_FORMAT = ord('F')
+LOG_CHAR = ord('C')
+LOG_DROPPED = ord('X')
+
+ESCAPES = {'\n': '\\n', '\r': '\\r', '\0': '\\0', '\t': '\\t', '\\': '\\'}
+
+
+class Flash:
+    """ The allocated sections of an AVR elf, addressed as the firmware sees them """
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            elf = f.read()
+        if elf[:4] != b'\x7fELF' or elf[4] != 1:
+            sys.exit(path + ' is not a 32 bit elf file')
+        shoff, = struct.unpack_from('<I', elf, 0x20)
+        shentsize, shnum = struct.unpack_from('<HH', elf, 0x2E)
+        self.sections = []
+        for i in range(shnum):
+            _, stype, flags, addr, offset, size = struct.unpack_from('<IIIIII', elf, shoff + i * shentsize)
+            if stype == 1 and flags & 2 and addr < 0x800000:  # PROGBITS, ALLOC and in flash, not RAM
+                self.sections.append((addr, elf[offset:offset + size]))
+
+    def string(self, address):
+        for addr, data in self.sections:
+            if addr <= address < addr + len(data):
+                end = data.find(b'\0', address - addr)
+                return data[address - addr:end].decode('latin-1')
+        return '<unknown string at 0x%04x>' % address
+
+
+def escape(text):
+    return ''.join(ESCAPES.get(c, c) for c in text)
+
+
+def pad(text, width, left):
+    return text.ljust(width) if left else text.rjust(width)
+
+
+def decode(flash, record):
+    """ Expand a LOG_FORMAT record the way StringFormatter::send2 would """
+    fmt, micros = struct.unpack_from('<HI', record)
+    pos = 6
+    format = flash.string(fmt)
+    out = ''
+    i = 0
+    while i < len(format):
+        c = format[i]
+        i += 1
+        if c != '%':
+            out += c
+            continue
+        width = 0
+        left = False
+        while i < len(format) and (format[i] == '-' or format[i].isdigit()):
+            if format[i] == '-':
+                left = True
+            else:
+                width = width * 10 + int(format[i])
+            i += 1
+        if i == len(format):
+            break
+        c = format[i]
+        i += 1
+        if c in 'cdbox':
+            value, = struct.unpack_from('<h', record, pos)
+            pos += 2
+            if c == 'c':
+                out += chr(value & 0xFF)
+            elif c == 'd':
+                out += pad(str(value), width, left) if width else str(value)
+            elif c == 'b':
+                out += bin(value & 0xFFFF)[2:]
+            elif c == 'o':
+                out += oct(value & 0xFFFF)[2:]
+            else:
+                out += '%X' % (value & 0xFFFF)
+        elif c == 'l':
+            value, = struct.unpack_from('<i', record, pos)
+            pos += 4
+            out += pad(str(value), width, left) if width else str(value)
+        elif c == 'f':
+            value, = struct.unpack_from('<f', record, pos)
+            pos += 4
+            out += '%.2f' % value
+        elif c in 'se':
+            length = record[pos]
+            text = record[pos + 1:pos + 1 + length].decode('latin-1')
+            pos += 1 + length
+            out += escape(text) if c == 'e' else text
+        elif c in 'SE':
+            address, = struct.unpack_from('<H', record, pos)
+            pos += 2
+            text = flash.string(address)
+            out += escape(text) if c == 'E' else text
+        elif c == '%':
+            out += '%'
+    return micros, out
+
+
+def main():
+    capture = sys.argv[1] if len(sys.argv) > 1 else None
+    if len(sys.argv) > 2:
+        elf = sys.argv[2]
+    else:
+        builds = sorted(glob.glob('/tmp/arduino_build_*/*.ino.elf'), key=os.path.getmtime)
+        if not builds:
+            sys.exit('No elf file given and no Arduino build found in /tmp')
+        elf = builds[-1]
+    flash = Flash(elf)
+    data = open(capture, 'rb').read() if capture else sys.stdin.buffer.read()
+
+    out = sys.stdout
+    i = 0
+    while i < len(data):
+        if data[i] != LOG_FRAME_START or i + 3 > len(data):
+            out.write(chr(data[i]))
+            i += 1
+            continue
+        rtype, length = data[i + 1], data[i + 2]
+        record = data[i + 3:i + 3 + length]
+        i += 3 + length
+        if rtype == LOG_FORMAT:
+            micros, text = decode(flash, record)
+            if text.startswith('\n'):
+                out.write('\n')
+                text = text[1:]
+            out.write('[%10d] %s' % (micros, text))
+        elif rtype == LOG_CHAR:
+            out.write(escape(record.decode('latin-1')))
+        elif rtype == LOG_DROPPED:
+            out.write('\n[log dropped %d records]\n' % struct.unpack_from('<H', record)[0])
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,491 @@
+#!/usr/bin/env python3
+#  © 2020, Chris Harlow. All rights reserved.
+#
+#  This file is part of DCC-EX CommandStation-EX
+#
+#  This is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  It is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+#
+# Stands in for an ESP8266 running the AT firmware, so the WiFi code can be
+# exercised and measured without the hardware.
+#
+# It speaks the AT commands WifiInterface and WifiInboundHandler use on a
+# pseudo terminal (the name is printed at startup) or on a real serial device
+# (--device, eg a USB adapter wired to Serial1 of a Mega).
+# Once the firmware has done AT+CIPSERVER=1,port, real TCP clients can connect
+# to that port on this machine, eg   telnet localhost 2560
+# As on the ESP, a TCP client that goes quiet for the AT+CIPSTO time is closed.
+#
+# --clients N adds N simulated throttles instead, each sending a command and
+# waiting for its reply before sending the next. After --duration seconds the
+# commands/second and reply latency are reported and the emulator exits.
+#
+# --latency, --busy, --error, --send-fail and --drop make the ESP slow or
+# unreliable in the ways the real one is.
+#
+#   espemu.py [--clients 3 --duration 10] [--latency 20 --busy 0.05 ...]
+
+import argparse
+import heapq
+import os
+import pty
+import random
+import select
+import socket
+import sys
+import termios
+import time
+import tty
+
+MAX_CLIENTS = 5       # link ids the AT firmware allows
+MAX_IPD = 1460        # TCP data delivered in one +IPD
+MAX_CIPSEND = 2048
+RECONNECT_DELAY = 0.1
+CLIENTS_START = 1.0   # after CIPSERVER, so the firmware has finished its setup
+REPLY_TIMEOUT = 2.0   # a simulated throttle gives up waiting and sends again
+
+BAUDS = {9600: termios.B9600, 19200: termios.B19200, 38400: termios.B38400, 57600: termios.B57600,
+         115200: termios.B115200, 230400: termios.B230400}
+
+
+class TcpClient:
+    """ A connection accepted on the CIPSERVER port """
+
+    def __init__(self, sock):
+        self.sock = sock
+        self.lastActive = time.monotonic()
+
+    def deliver(self, emulator, data):
+        self.lastActive = time.monotonic()
+        try:
+            self.sock.sendall(data)
+        except OSError:
+            pass
+
+    def close(self):
+        self.sock.close()
+
+
+class SimulatedClient:
+    """ A throttle that sends one command and waits for its reply before the next """
+
+    def __init__(self, number, args):
+        self.number = number
+        self.args = args
+        self.received = b''
+        self.expected = None
+        self.sentAt = 0
+        self.speed = 0
+
+    def start(self, emulator, linkId):
+        self.linkId = linkId
+        self.sendNext(emulator)
+
+    def fields(self):
+        return {'reg': self.number + 1, 'cab': self.number + 3, 'speed': self.speed}
+
+    def sendNext(self, emulator):
+        self.speed = (self.speed + 1) % 127
+        command = self.args.command.format(**self.fields())
+        self.expected = self.args.reply.format(**self.fields()).encode()
+        self.received = b''
+        self.sentAt = time.monotonic()
+        emulator.stats['commands'] += 1
+        emulator.ipd(self.linkId, command.encode())
+
+    def deliver(self, emulator, data):
+        self.received += data
+        if self.expected and self.expected in self.received:
+            emulator.latencies.append(time.monotonic() - self.sentAt)
+            self.expected = None
+            emulator.at(time.monotonic() + self.args.think / 1000.0, lambda: self.sendNext(emulator))
+
+    def check(self, emulator):
+        if self.expected and time.monotonic() - self.sentAt > REPLY_TIMEOUT:
+            emulator.stats['lost'] += 1
+            self.sendNext(emulator)
+
+    def close(self):
+        self.expected = None
+
+
+class Emulator:
+
+    def __init__(self, fd, args):
+        self.fd = fd
+        self.args = args
+        self.echo = True
+        self.mode = 1
+        self.joined = False
+        self.server = None
+        self.idleTimeout = 180   # AT+CIPSTO seconds, 0 never
+        self.links = [None] * MAX_CLIENTS
+        self.rx = b''
+        self.tx = b''
+        self.txClock = 0
+        self.baud = args.baud
+        self.bytesPerSecond = args.baud / 10.0
+        self.timers = []    # (due, seq, action)
+        self.seq = 0
+        self.busyUntil = 0
+        self.busyWhy = 'p'
+        self.sending = None  # (link id, bytes still to come, data so far) after a CIPSEND '>'
+        self.simulated = [SimulatedClient(n, args) for n in range(args.clients)]
+        self.stats = dict(commands=0, lost=0, cipsends=0, bytes=0, busy=0, errors=0, sendFails=0, drops=0)
+        self.latencies = []
+        self.benchStart = None
+        self.at(time.monotonic(), lambda: self.send('\r\nready\r\n'))
+
+    # output to the firmware, after a delay and paced at the baud rate
+
+    def at(self, due, action):
+        self.seq += 1
+        heapq.heappush(self.timers, (due, self.seq, action))
+
+    def send(self, data):
+        if isinstance(data, str):
+            data = data.encode('latin-1')
+        if not self.tx:
+            self.txClock = time.monotonic()
+        self.tx += data
+
+    def reply(self, data, delay=None):
+        if delay is None:
+            delay = self.args.latency + random.uniform(0, self.args.jitter)
+        self.at(time.monotonic() + delay / 1000.0, lambda: self.send(data))
+
+    def pump(self):
+        now = time.monotonic()
+        while self.timers and self.timers[0][0] <= now:
+            heapq.heappop(self.timers)[2]()
+        if not self.tx:
+            return
+        count = len(self.tx)
+        if self.bytesPerSecond and self.txClock < now - 0.01:
+            self.txClock = now - 0.01   # the link was idle, don't send a burst to catch up
+        if self.bytesPerSecond:
+            count = min(count, int((now - self.txClock) * self.bytesPerSecond))
+        if count:
+            data = self.tx[:count]
+            if self.args.max_baud and self.baud > self.args.max_baud:
+                data = data[::2]   # the firmware can't keep up, it loses bytes
+            os.write(self.fd, data)
+            written = count
+            self.tx = self.tx[written:]
+            self.txClock += written / self.bytesPerSecond if self.bytesPerSecond else 0
+
+    def nextWake(self):
+        wake = 0.05
+        if self.timers:
+            wake = min(wake, max(0, self.timers[0][0] - time.monotonic()))
+        if self.tx:
+            wake = min(wake, 0.001)
+        return wake
+
+    # input from the firmware
+
+    def received(self, data):
+        self.rx += data
+        while self.rx:
+            if self.sending:
+                self.sendData()
+                continue
+            end = self.rx.find(b'\n')
+            if end < 0:
+                return
+            line = self.rx[:end].strip(b'\r').decode('latin-1')
+            self.rx = self.rx[end + 1:]
+            if line:
+                self.command(line)
+
+    def command(self, line):
+        if self.echo:
+            self.send(line + '\r\n')
+        if time.monotonic() < self.busyUntil:
+            self.send('busy %s...\r\n' % self.busyWhy)
+            self.stats['busy'] += 1
+            return
+        verb, _, params = line.partition('=')
+        verb = verb.upper()
+        ok = '\r\nOK\r\n'
+        if verb in ('AT', 'AT+CWMODE', 'AT+CWHOSTNAME', 'AT+CIPRECVMODE', 'AT+CWSAP', 'AT+CWSAP_CUR'):
+            if verb == 'AT+CWMODE':
+                self.mode = int(params or 1)
+            self.reply(ok)
+        elif verb in ('ATE0', 'ATE1'):
+            self.echo = verb == 'ATE1'
+            self.reply(ok)
+        elif verb == 'AT+GMR':
+            self.reply('AT version:1.7.4.0(espemu)\r\nSDK version:3.0.4\r\n' + ok)
+        elif verb == 'AT+RST':
+            self.reply(ok)
+            self.reply('\r\nready\r\n', 500)
+        elif verb == 'AT+CWJAP?':
+            self.reply('No AP\r\n' + ok)
+        elif verb in ('AT+CWJAP', 'AT+CWJAP_CUR'):
+            self.busy(self.args.join_delay, 'p')
+            self.joined = True
+            self.reply('WIFI CONNECTED\r\nWIFI GOT IP\r\n' + ok, self.args.join_delay)
+        elif verb == 'AT+CIFSR':
+            if self.mode == 2:
+                addresses = '+CIFSR:APIP,"192.168.4.1"\r\n+CIFSR:APMAC,"be:dd:c2:5c:6b:b7"\r\n'
+            else:
+                addresses = '+CIFSR:STAIP,"%s"\r\n+CIFSR:STAMAC,"bc:dd:c2:5c:6b:b7"\r\n' % (
+                    '127.0.0.1' if self.joined else '0.0.0.0')
+            self.reply(addresses + ok)
+        elif verb == 'AT+UART_CUR':
+            speed = int(params.split(',')[0])
+            self.reply(ok)
+            self.at(time.monotonic() + self.args.latency / 1000.0 + 0.001, lambda: self.setSpeed(speed))
+        elif verb == 'AT+CIPMUX':
+            self.reply(ok)
+        elif verb == 'AT+CIPSERVER':
+            fields = params.split(',')
+            if fields[0] == '1':
+                self.listen(self.args.port or int(fields[1] if len(fields) > 1 else 333))
+            self.reply(ok)
+        elif verb == 'AT+CIPSTO':
+            self.idleTimeout = int(params)
+            self.reply(ok)
+        elif verb == 'AT+CIPSEND':
+            self.cipsend(params)
+        elif verb == 'AT+CIPCLOSE':
+            linkId = int(params)
+            self.reply(self.close(linkId) + ok)
+        else:
+            self.reply('\r\nERROR\r\n')
+
+    def setSpeed(self, speed):
+        """ AT+UART_CUR, after the OK has gone at the old speed """
+        while self.tx:
+            self.pump()
+        self.baud = speed
+        self.bytesPerSecond = speed / 10.0 if self.args.baud else 0
+        if self.args.device and speed in BAUDS:
+            attributes = termios.tcgetattr(self.fd)
+            attributes[4] = attributes[5] = BAUDS[speed]
+            termios.tcsetattr(self.fd, termios.TCSADRAIN, attributes)
+        print('espemu: link at %d baud' % speed, file=sys.stderr)
+
+    def busy(self, milliseconds, why):
+        self.busyUntil = time.monotonic() + milliseconds / 1000.0
+        self.busyWhy = why
+
+    def cipsend(self, params):
+        try:
+            linkId, length = (int(x) for x in params.split(','))
+        except ValueError:
+            self.reply('\r\nERROR\r\n')
+            return
+        if not 0 <= linkId < MAX_CLIENTS or not self.links[linkId] or not 0 < length <= MAX_CIPSEND:
+            self.reply('link is not valid\r\n\r\nERROR\r\n')
+            self.stats['errors'] += 1
+            return
+        self.stats['cipsends'] += 1
+        chance = random.random()
+        if chance < self.args.busy:
+            self.stats['busy'] += 1
+            self.reply('busy p...\r\n')
+        elif chance < self.args.busy + self.args.error:
+            self.stats['errors'] += 1
+            self.reply('\r\nERROR\r\n')
+        elif chance < self.args.busy + self.args.error + self.args.drop:
+            self.stats['drops'] += 1
+            self.reply(self.close(linkId) + '\r\nERROR\r\n')
+        else:
+            self.sending = (linkId, length, b'')
+            self.reply('\r\nOK\r\n> ')
+
+    def sendData(self):
+        linkId, length, data = self.sending
+        take = self.rx[:length - len(data)]
+        self.rx = self.rx[len(take):]
+        data += take
+        if len(data) < length:
+            self.sending = (linkId, length, data)
+            return
+        self.sending = None
+        self.stats['bytes'] += length
+        self.busy(self.args.latency, 's')   # still sending, the next command gets busy s...
+        link = self.links[linkId]
+        delay = self.args.latency + random.uniform(0, self.args.jitter)
+        if random.random() < self.args.send_fail:
+            self.stats['sendFails'] += 1
+            self.reply('\r\nRecv %d bytes\r\n\r\nSEND FAIL\r\n' % length, delay)
+            return
+        if link:
+            self.at(time.monotonic() + delay / 1000.0, lambda: link.deliver(self, data))
+        self.reply('\r\nRecv %d bytes\r\n\r\nSEND OK\r\n' % length, delay)
+
+    # the TCP side
+
+    def listen(self, port):
+        if self.server:
+            return
+        self.server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.server.bind((self.args.bind, port))
+        self.server.listen(MAX_CLIENTS)
+        print('espemu: server listening on %s:%d' % (self.args.bind, port), file=sys.stderr)
+        self.at(time.monotonic() + CLIENTS_START, self.startBenchmark)
+
+    def startBenchmark(self):
+        for client in self.simulated:
+            self.connect(client)
+        if self.simulated:
+            self.benchStart = time.monotonic()
+
+    def connect(self, client):
+        if None not in self.links:
+            client.close()
+            return
+        linkId = self.links.index(None)
+        self.links[linkId] = client
+        self.send('%d,CONNECT\r\n' % linkId)
+        if isinstance(client, SimulatedClient):
+            self.at(time.monotonic() + 0.01, lambda: client.start(self, linkId))
+
+    def close(self, linkId):
+        """ Drops the link, returns what the ESP says about it """
+        link = self.links[linkId]
+        if not link:
+            return ''
+        self.links[linkId] = None
+        link.close()
+        if isinstance(link, SimulatedClient):
+            self.at(time.monotonic() + RECONNECT_DELAY, lambda: self.connect(link))
+        return '%d,CLOSED\r\n' % linkId
+
+    def ipd(self, linkId, data):
+        for start in range(0, len(data), MAX_IPD):
+            chunk = data[start:start + MAX_IPD]
+            delay = self.args.net_latency / 1000.0
+            self.at(time.monotonic() + delay,
+                    lambda chunk=chunk: self.send(b'\r\n+IPD,%d,%d:' % (linkId, len(chunk)) + chunk))
+
+    def tcpReadable(self, linkId):
+        link = self.links[linkId]
+        try:
+            data = link.sock.recv(MAX_IPD)
+        except OSError:
+            data = b''
+        if data:
+            link.lastActive = time.monotonic()
+            self.ipd(linkId, data)
+        else:
+            self.send(self.close(linkId))
+
+    def closeIdle(self):
+        """ The server timeout, only real TCP clients go quiet """
+        if not self.idleTimeout:
+            return
+        for linkId, link in enumerate(self.links):
+            if isinstance(link, TcpClient) and time.monotonic() - link.lastActive > self.idleTimeout:
+                self.send(self.close(linkId))
+
+    # the benchmark
+
+    def benchDone(self):
+        return self.benchStart and time.monotonic() - self.benchStart >= self.args.duration
+
+    def report(self):
+        elapsed = time.monotonic() - self.benchStart
+        latencies = sorted(self.latencies)
+        stats = self.stats
+        print('%d clients for %.1fs: %d replies, %.1f commands/sec, %d lost' %
+              (len(self.simulated), elapsed, len(latencies), len(latencies) / elapsed, stats['lost']))
+        if latencies:
+            print('reply latency ms: avg %.1f  median %.1f  95%% %.1f  max %.1f' %
+                  (1000 * sum(latencies) / len(latencies), 1000 * latencies[len(latencies) // 2],
+                   1000 * latencies[int(len(latencies) * 0.95)], 1000 * latencies[-1]))
+        print('CIPSENDs %d  bytes %d (%.1f/CIPSEND)  busy %d  errors %d  send fails %d  drops %d' %
+              (stats['cipsends'], stats['bytes'], stats['bytes'] / max(1, stats['cipsends']),
+               stats['busy'], stats['errors'], stats['sendFails'], stats['drops']))
+
+    def run(self):
+        while not self.benchDone():
+            readers = [self.fd]
+            if self.server:
+                readers.append(self.server)
+            readers += [link.sock for link in self.links if isinstance(link, TcpClient)]
+            readable, _, _ = select.select(readers, [], [], self.nextWake())
+            for r in readable:
+                if r == self.fd:
+                    try:
+                        self.received(os.read(self.fd, 4096))
+                    except OSError:  # the other end of the pty is not open yet
+                        time.sleep(0.1)
+                elif r == self.server:
+                    sock, _ = self.server.accept()
+                    self.connect(TcpClient(sock))
+                else:
+                    self.tcpReadable([l.sock if l else None for l in self.links].index(r))
+            for client in self.simulated:
+                client.check(self)
+            self.closeIdle()
+            self.pump()
+        self.report()
+
+
+def openDevice(args):
+    if args.device:
+        fd = os.open(args.device, os.O_RDWR | os.O_NOCTTY)
+        tty.setraw(fd)
+        attributes = termios.tcgetattr(fd)
+        attributes[4] = attributes[5] = BAUDS[args.baud]
+        termios.tcsetattr(fd, termios.TCSANOW, attributes)
+        return fd
+    master, slave = pty.openpty()
+    tty.setraw(slave)
+    tty.setraw(master)
+    print('espemu: ESP on %s' % os.ttyname(slave), file=sys.stderr)
+    openDevice.slave = slave   # kept open so the pty survives the firmware reconnecting
+    return master
+
+
+def main():
+    parser = argparse.ArgumentParser(description='ESP8266 AT firmware emulator')
+    parser.add_argument('--device', help='serial device to use instead of a pseudo terminal')
+    parser.add_argument('--baud', type=int, default=115200,
+                        help='serial link speed, output is paced to it (0 = unpaced)')
+    parser.add_argument('--max-baud', type=int, default=0,
+                        help='above this AT+UART_CUR speed the firmware loses bytes, to test its fallback')
+    parser.add_argument('--port', type=int, help='TCP port to listen on instead of the CIPSERVER one')
+    parser.add_argument('--bind', default='127.0.0.1')
+    parser.add_argument('--latency', type=float, default=5, help='ms before the ESP answers a command')
+    parser.add_argument('--jitter', type=float, default=0, help='up to this many ms added to each latency')
+    parser.add_argument('--net-latency', type=float, default=0, help='ms before client data arrives as +IPD')
+    parser.add_argument('--join-delay', type=float, default=1000, help='ms to join the access point')
+    parser.add_argument('--busy', type=float, default=0, help='chance a CIPSEND is answered busy p...')
+    parser.add_argument('--error', type=float, default=0, help='chance a CIPSEND is answered ERROR')
+    parser.add_argument('--send-fail', type=float, default=0, help='chance of SEND FAIL after the data')
+    parser.add_argument('--drop', type=float, default=0, help='chance a CIPSEND finds the link closed')
+    parser.add_argument('--clients', type=int, default=0, help='simulated throttles to benchmark with')
+    parser.add_argument('--duration', type=float, default=10, help='seconds to benchmark for')
+    parser.add_argument('--think', type=float, default=0, help='ms a throttle waits after a reply')
+    parser.add_argument('--command', default='<t {reg} {cab} {speed} 1>',
+                        help='what each throttle sends, {reg} {cab} and {speed} are filled in')
+    parser.add_argument('--reply', default='<T {reg} {speed} 1>', help='the reply that answers it')
+    parser.add_argument('--seed', type=int, help='random seed, to repeat a run')
+    args = parser.parse_args()
+    if args.clients > MAX_CLIENTS:
+        parser.error('the AT firmware allows at most %d clients' % MAX_CLIENTS)
+    if args.baud and args.device and args.baud not in BAUDS:
+        parser.error('unsupported baud rate %d' % args.baud)
+    if args.seed is not None:
+        random.seed(args.seed)
+    Emulator(openDevice(args), args).run()
+
+
+if __name__ == '__main__':
+    main()